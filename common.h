@@ -22,17 +22,33 @@
 #define ERROR "07"
 #define OK "08"
 
+/// Federation Messages (only exchanged between server nodes)
+#define PEER_HELLO "09"
+
 /// Error Codes
 #define ERR_EQUIPMENT_NOT_FOUND "01"
 #define ERR_SOURCE_EQUIPMENT_NOT_FOUND "02"
 #define ERR_TARGET_EQUIPMENT_NOT_FOUND "03"
 #define ERR_EQUIPMENT_LIMIT_EXCEEDED "04"
+#define ERR_RATE_LIMITED "05"
+#define ERR_NO_PENDING_REQUEST "06"
+#define ERR_INVALID_MESSAGE "07"
 
 /// Confirmation codes
 #define SUCCESSFUL_REMOVAL "01"
 
 #define MAX_EQUIPMENTS 15
 
+/// Destination id of a REQ_INF addressed to every other equipment of the requester's group
+#define GROUP_DESTINATION 0
+
+/// Group an equipment joins when it does not name one, and the maximum size of a group name (including the terminator)
+#define DEFAULT_GROUP "default"
+#define MAX_GROUP_NAME 32
+
+/// Size of a resume token (16 hex digits and the terminator)
+#define RESUME_TOKEN_SIZE 17
+
 
 /// Struct to store the parameters send on the execution of the command to start the program
 typedef struct parameters Parameters;
@@ -56,9 +72,9 @@ struct parameters {
 bool initProgram(Parameters *p, bool client, int argc, const char *argv[]) {
 	if(argc < 3 - (client ? 0 : 1)) {
 		if(client){
-			printf("Usage: %s <IP> <port>\n", argv[0]);
+			printf("Usage: %s <IP> <port> [group] [equipments]\n", argv[0]);
 		}else{
-			printf("Usage: %s <port>\n", argv[0]);
+			printf("Usage: %s <port> [takeover] [node <index> <secret> <IP>:<port>...]\n", argv[0]);
 		}
 		return false;
 	}
@@ -83,15 +99,21 @@ bool initProgram(Parameters *p, bool client, int argc, const char *argv[]) {
  * @param splitChar: character to split the message with
  */
 void split(char *message, char **tokens, int *count, char* splitChar) {
-	char *token = strtok(message, splitChar);
+	// strtok_r keeps its position on the caller's stack, several threads split their messages at once
+	char *position;
+	char *token = strtok_r(message, splitChar, &position);
 
 	
 	int c = 0;
    	while(token != NULL ) {
 		tokens[c++] = token;
-      	token = strtok(NULL, splitChar);
+      	token = strtok_r(NULL, splitChar, &position);
    	}
-	// remove \n from last token
-	tokens[c-1] = strtok(tokens[c-1], "\n");
+	// remove \n from last token (a message of separators only is left with a single empty one)
+	if(c == 0) {
+		tokens[c++] = "";
+	}
+	char *last = strtok_r(tokens[c-1], "\n", &position);
+	tokens[c-1] = last != NULL ? last : "";
 	*count = c;
 }
@@ -13,19 +13,42 @@
 #define CLOSE_CONNECTION_COMMAND "close connection"
 #define LIST_EQUIPMENTS_COMMAND "list equipment"
 #define REQUEST_INFO_COMMAND "request information from"
+#define ADD_EQUIPMENT_COMMAND "add equipment"
+#define USE_EQUIPMENT_COMMAND "use equipment"
 
-/// Store this equipment's id
+/// Target of REQUEST_INFO_COMMAND that requests information from every other equipment of this equipment's group
+#define GROUP_TARGET "group"
+
+/// How many times (one per second) the equipment tries to reconnect when the server goes down
+#define RECONNECT_ATTEMPTS 30
+
+/// Store the id of the equipment the commands act on
 int thisId = -1;
 
-/// Store whether an id has been assigned to this equipment
-bool idDefined = false;
+/// Store which equipments were registered by this connection (a gateway registers one virtual equipment per sensor)
+bool localEquipments[MAX_EQUIPMENTS + 1];
+
+/// Store which of this connection's equipments are being resumed after the server went down
+bool resumingEquipments[MAX_EQUIPMENTS + 1];
 
-/// Store which equipments are connected to the server
+/// Number of resume requests sent on the last reconnection the server did not answer yet (with an id or an error)
+int unansweredResumes = 0;
+
+/// Store which equipments of this equipment's group are connected to the server
 bool equipments[MAX_EQUIPMENTS + 1];
 
+/// The group this equipment joins, only the equipments of the same group are listed and notified to it
+char groupName[MAX_GROUP_NAME] = DEFAULT_GROUP;
+
 /// Id of the socket connection to communicate with the server
 int sock = 0;
 
+/// Address of the server, kept to reconnect to it
+struct sockaddr_storage addServerStorage;
+
+/// Tokens received on RES_ADD, presented to the server to get each equipment's id back after it restarts
+char resumeTokens[MAX_EQUIPMENTS + 1][RESUME_TOKEN_SIZE];
+
 /**
  * Organize and send a message to the server.
  *
@@ -46,12 +69,38 @@ void _sendMessage(char* idMsg, int originEqId, int destinationEqId, char* payloa
 		sprintf(message, "%s %s%d", message, destinationEqId < 10 ? "0" : "", destinationEqId);
 	}
 
-	if(strcmp(idMsg, RES_INF) == 0) {
+	if(strcmp(idMsg, RES_INF) == 0 || (strcmp(idMsg, REQ_ADD) == 0 && strlen(payload) > 0)) {
 		sprintf(message, "%s %s", message, payload);
 	}
 
 	sprintf(message, "%s\n", message);
-	send(sock, message, strlen(message), 0);
+	send(sock, message, strlen(message), MSG_NOSIGNAL);
+}
+
+/// Find the first equipment registered by this connection (if there is none, return -1)
+int _firstLocalEquipment() {
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(localEquipments[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Count an answer to a resume request. Once every one was answered, the equipments still waiting will not come back
+ * (the server gave new ids or refused them), so the selected one is picked again among the local ones if it is not local anymore.
+ */
+void _finishResume() {
+	if(unansweredResumes == 0 || --unansweredResumes > 0) {
+		return;
+	}
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		resumingEquipments[i] = false;
+	}
+	if(thisId == -1 || !localEquipments[thisId]) {
+		thisId = _firstLocalEquipment();
+	}
 }
 
 /**
@@ -70,38 +119,61 @@ void _handleError(char **tokens, int size) {
 		printf("Target equipment not found\n");
 	} else if(strcmp(errorType, ERR_EQUIPMENT_LIMIT_EXCEEDED) == 0) { 
 		printf("Equipment limit exceeded\n");
+		_finishResume();
+	} else if(strcmp(errorType, ERR_RATE_LIMITED) == 0) { 
+		printf("Request throttled\n");
+	} else if(strcmp(errorType, ERR_NO_PENDING_REQUEST) == 0) { 
+		printf("No pending request\n");
+	} else if(strcmp(errorType, ERR_INVALID_MESSAGE) == 0) { 
+		printf("Invalid message\n");
 	}
 }
 
 /**
  * Handle an OK message from the server
  * 
- * @param tokens : The array of tokens of the message
+ * @param tokens : The array of tokens of the message (first position should be the equipment the confirmation applies to)
  * @param size : The size of the array of tokens
  */
 void _handleOk(char **tokens, int size) {
 	char* errorType = tokens[1];
 	if(strcmp(errorType, SUCCESSFUL_REMOVAL) == 0) { 
 		printf("Successful removal\n");
-		exit(0);
+		int eqId = atoi(tokens[0]);
+		localEquipments[eqId] = false;
+		equipments[eqId] = false;
+
+		// the connection is closed along with its last equipment
+		if(_firstLocalEquipment() == -1) {
+			exit(0);
+		}
+		if(eqId == thisId) {
+			thisId = _firstLocalEquipment();
+		}
 	}
 }
 
 /**
- * Handle the message that is received when another equipment connects to the server
+ * Handle the message that is received when an equipment connects to the server
  * 
- * @param tokens : The array of tokens of the message (first position should be the added equipment's id)
+ * @param tokens : The array of tokens of the message (first position should be the added equipment's id, followed by the resume token when it was registered by this connection)
  * @param size : The size of the array of tokens
  */
 void _handleEquipmenetAdded(char **tokens, int size) {
 	int eqId = atoi(tokens[0]);
 	
-	if(idDefined) {
+	if(size < 2) {
 		printf("Equipment %s added\n", tokens[0]);
 	}else{
-		idDefined = true;
-		printf("New ID: %s\n", tokens[0]);
-		thisId = eqId;
+		printf("%s ID: %s\n", resumingEquipments[eqId] ? "Resumed" : "New", tokens[0]);
+		resumingEquipments[eqId] = false;
+		localEquipments[eqId] = true;
+		strncpy(resumeTokens[eqId], tokens[1], RESUME_TOKEN_SIZE - 1);
+		// the first equipment (or the first one back after a restart, if the selected one is not) becomes the selected one
+		if(thisId == -1 || (!localEquipments[thisId] && !resumingEquipments[thisId])) {
+			thisId = eqId;
+		}
+		_finishResume();
 	}
 	equipments[eqId] = true;
 }
@@ -141,14 +213,14 @@ void _handleRequestInfo(char **tokens, int size) {
 /**
  * Handle the message that is received when this equipment receives the requested information from another equipment
  * 
- * @param tokens : The array of tokens of the message (second position should be the id of the responding equipment and the third the value of the information)
+ * @param tokens : The array of tokens of the message (first position should be the id of the responding equipment and the third the value of the information)
  * @param size : The size of the array of tokens
  */
 void _handleRequestResInfo(char **tokens, int size) {
-	char* destinationId = tokens[1];
+	char* respondingId = tokens[0];
 	char* payload = tokens[2];
 	
-	printf("Value from %s: %s\n", destinationId, payload);
+	printf("Value from %s: %s\n", respondingId, payload);
 }
 
 /**
@@ -206,6 +278,52 @@ void _handleServerMessage(char *message) {
 	free(subtokens);
 }
 
+/**
+ * Open a new connection to the server
+ * 
+ * @return true if the connection was established, false otherwise
+ */
+bool _connectToServer() {
+	// Initialize socket
+	if ((sock = socket(addServerStorage.ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		printf("\n Socket creation error \n");
+		return false;
+	}
+
+	// Try to connect to the server
+	if (connect(sock, (struct sockaddr *) &addServerStorage, sizeof(struct sockaddr_in)) < 0) {
+		close(sock);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Reconnect to a restarted server and present the resume tokens to get the ids of this connection's equipments back
+ * 
+ * @return true if the connection was established again, false otherwise
+ */
+bool _reconnect() {
+	close(sock);
+	for(int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+		sleep(1);
+		if(_connectToServer()) {
+			unansweredResumes = 0;
+			for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+				if(!localEquipments[i]) continue;
+				char payload[MAX_BYTES] = { 0 };
+				sprintf(payload, "%s %s%d %s", groupName, i < 10 ? "0" : "", i, resumeTokens[i]);
+				localEquipments[i] = false;
+				resumingEquipments[i] = true;
+				unansweredResumes++;
+				_sendMessage(REQ_ADD, -1, -1, payload);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
 /**
  * A thread that listens to the server and handles the messages received
  * 
@@ -215,22 +333,41 @@ void *threadReceiveMessage(void *arg) {
 	int sock = *((int *)arg);
 	
 	int valread;
-	char buffer[MAX_BYTES] = { 0 };
+	// Bytes of a message that was not fully received yet are kept at the start of the buffer
+	char buffer[MAX_BYTES * 2 + 1] = { 0 };
+	size_t pending = 0;
 
 	while (true) {
 		// read message from server
-		valread = read(sock, buffer, MAX_BYTES);
-		if(valread == 0) {
-			exit(0);
+		valread = read(sock, buffer + pending, MAX_BYTES);
+		if(valread <= 0) {
+			// the server went down, try to resume the sessions on its next run
+			if(_firstLocalEquipment() == -1 || !_reconnect()) {
+				exit(0);
+			}
+			sock = *((int *)arg);
+			pending = 0;
+			continue;
+		}
+		pending += valread;
+		buffer[pending] = '\0';
+
+		// The server batches the messages of a connection on a single write, handle every complete line
+		char *line = buffer;
+		char *end;
+		while((end = strchr(line, '\n')) != NULL) {
+			*end = '\0';
+			if(*line != '\0') {
+				_handleServerMessage(line);
+			}
+			line = end + 1;
 		}
 
-		char **messages = malloc(sizeof(char *) * MAX_TOKENS);
-		int messageCount; split(buffer, messages, &messageCount, "\n");
-		for(int i = 0; i < messageCount; i++) {
-			_handleServerMessage(messages[i]);
+		pending = buffer + pending - line;
+		if(pending >= MAX_BYTES) {
+			pending = 0;
 		}
-		memset(buffer, 0, sizeof(buffer));
-		free(messages);
+		memmove(buffer, line, pending);
 	}
 	
 	
@@ -239,12 +376,12 @@ void *threadReceiveMessage(void *arg) {
 }
 
 /**
- * List all the connected equipments
+ * List all the connected equipments (except the ones registered by this connection)
  */
 void _listEquipments() {
 	bool first = true;
 	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
-		if(equipments[i] && i != thisId) {
+		if(equipments[i] && !localEquipments[i]) {
 			if(!first) printf(" ");
 			printf("%s%d", i < 10 ? "0" : "", i);
 			first = false;
@@ -270,11 +407,33 @@ void _executeCommand(char* command, size_t commandSize) {
 		return;
 	}
 
+	if(strstr(command, ADD_EQUIPMENT_COMMAND) != NULL) {
+		_sendMessage(REQ_ADD, -1, -1, groupName);
+		return;
+	}
+
+	if(strstr(command, USE_EQUIPMENT_COMMAND) != NULL) {
+		char **parts = malloc(sizeof(char *) * 3);
+		int partsCount; split(command, parts, &partsCount, " ");
+		int eqId = atoi(parts[partsCount-1]);
+		if(eqId > 0 && eqId <= MAX_EQUIPMENTS && localEquipments[eqId]) {
+			thisId = eqId;
+		} else {
+			printf("Equipment not found\n");
+		}
+		free(parts);
+		return;
+	}
+
 	if(strstr(command, REQUEST_INFO_COMMAND) != NULL) {
 		char **parts = malloc(sizeof(char *) * 4);
 		int partsCount; split(command, parts, &partsCount, " ");
 		char* requestInfEqId = parts[partsCount-1];
-		_sendMessage(REQ_INF, thisId, atoi(requestInfEqId), "");
+		if(strcmp(requestInfEqId, GROUP_TARGET) == 0) {
+			_sendMessage(REQ_INF, thisId, GROUP_DESTINATION, "");
+		} else {
+			_sendMessage(REQ_INF, thisId, atoi(requestInfEqId), "");
+		}
 		free(parts);
 	} else {
 		printf("Invalid command\n");
@@ -293,11 +452,14 @@ int main(int argc, char const* argv[])
 	if(!initProgram(p, true, argc, argv)) {
 		return 1;
 	}
+	if(argc > 3) {
+		strncpy(groupName, argv[3], MAX_GROUP_NAME - 1);
+	}
+	// A gateway registers several virtual equipments over this single connection
+	int equipmentCount = argc > 4 ? atoi(argv[4]) : 1;
 	int protocol =AF_INET;
 
-	struct sockaddr_storage addServerStorage;
   	memset(&addServerStorage, 0, sizeof(addServerStorage));
-	int servSize;
 	struct sockaddr_in *serverAddress = (struct sockaddr_in *) &addServerStorage;
 	serverAddress->sin_family = protocol;
 	serverAddress->sin_addr.s_addr = INADDR_ANY;
@@ -306,18 +468,8 @@ int main(int argc, char const* argv[])
 		printf("\nInvalid address/ Address not supported \n");
 		return -1;
 	}
-	servSize = sizeof(*serverAddress);
-	struct sockaddr *serv_addr = (struct sockaddr *) &addServerStorage;
 
-
-	// Initialize socket
-	if ((sock = socket(protocol, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		printf("\n Socket creation error \n");
-		return -1;
-	}
-
-	// Try to connect to the server
-	if (connect(sock, serv_addr, servSize) < 0) {
+	if (!_connectToServer()) {
 		printf("\nConnection Failed \n");
 		return -1;
 	}
@@ -327,7 +479,9 @@ int main(int argc, char const* argv[])
 	pthread_t thread;
 	pthread_create(&thread, NULL, threadReceiveMessage, (void *)&sock);
 
-	_sendMessage(REQ_ADD, -1, -1, "");
+	for(int i = 0; i < equipmentCount; i++) {
+		_sendMessage(REQ_ADD, -1, -1, groupName);
+	}
 
 	while(true) {
 		size_t bufsize;
@@ -0,0 +1,147 @@
+"""Three federated servers on localhost: checks the links between them and measures the relay across nodes.
+
+- round trips of REQ_INF/RES_INF between equipments of the same node and of two different nodes
+- how many RES_INF a second the nodes relay at saturation, on the same node and across nodes: on a build without rate limits
+  (the limits would cap the rate offered, not the relay), each requester keeps a window of REQ_INF outstanding
+- a client claiming to be a node (PEER_HELLO without the federation's secret) is not taken as its link
+- requests from two nodes to the same target are rate limited by the target's node, which sees them all
+- once a node is down its equipments are reported as not found instead of the requests being lost
+
+Usage: python3 scripts/federation_bench.py [server binary] [first port] [pings] [server binary without rate limits]
+(the one without rate limits is built from server.c when not given)
+"""
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+from tp2 import REQ_INF, Equipment, Server, latencies, ping, report, wait_until
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "./server"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 5160
+pings = int(sys.argv[3]) if len(sys.argv) > 3 else 100
+unlimited = sys.argv[4] if len(sys.argv) > 4 else None
+NODES = 3
+SECRET = "federation-bench"
+RATE_LIMITED, TARGET_NOT_FOUND = "05", "03"
+
+ports = [port + node for node in range(NODES)]
+addresses = ["127.0.0.1:%d" % p for p in ports]
+servers = []
+failures = []
+
+
+def check(condition, message):
+    print("%-60s %s" % (message, "ok" if condition else "FAILED"))
+    if not condition:
+        failures.append(message)
+
+
+def reach(equipment, destination):
+    """Whether a REQ_INF from the equipment to the destination is answered."""
+    return ping(equipment, equipment.ids[0], destination, 0.5) is not None
+
+
+def build_unlimited():
+    """Build the server with rate limits out of reach."""
+    built = os.path.join(tempfile.mkdtemp(prefix="tp2-"), "server")
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "server.c")
+    subprocess.run(["gcc", "-pthread", "-o", built, source, "-Wformat-overflow=0", "-DRATE_LIMIT_PER_SECOND=1e9", "-DRATE_LIMIT_BURST=1e9"], check=True)
+    return built
+
+
+def saturate(requesters, destinations, seconds=3, window=256):
+    """Every requester keeps `window` REQ_INF to its destination outstanding, sending new ones as the RES_INF come back.
+    Returns the RES_INF received per second and how many were lost."""
+    before = [len(r.responses) for r in requesters]
+    received = lambda: sum(len(r.responses) - b for r, b in zip(requesters, before))
+    sent = [0] * len(requesters)
+    start = time.time()
+    while time.time() - start < seconds:
+        for k, (requester, destination) in enumerate(zip(requesters, destinations)):
+            missing = window - (sent[k] - (len(requester.responses) - before[k]))
+            if missing > 0:
+                requester.send(("%s %02d %02d\n" % (REQ_INF, requester.ids[0], destination)) * missing)
+                sent[k] += missing
+        time.sleep(0.0005)
+    rate = received() / (time.time() - start)
+    wait_until(lambda: received() >= sum(sent))
+    return rate, sum(sent) - received()
+
+
+try:
+    for node in range(NODES):
+        servers.append(Server(binary, ports[node], "node", node, SECRET, *addresses))
+
+    # equipments get ids from the node they connect to, the others learn them over the links
+    local = [Equipment(p) for p in ports]
+    requester = Equipment(ports[1])
+    linked = wait_until(lambda: reach(requester, local[0].ids[0]) and reach(requester, local[2].ids[0]))
+    check(linked, "equipments of every node reachable from node 1")
+
+    rounds, lost = latencies(requester, requester.ids[0], local[1].ids[0], pings)
+    report("same node", rounds, lost)
+    rounds, lost = latencies(requester, requester.ids[0], local[0].ids[0], pings)
+    report("across nodes", rounds, lost)
+    check(lost == 0, "no round trip lost across nodes")
+
+    # a client claims to be node 2, with a wrong secret, and announces an id node 2 owns
+    fake = socket.create_connection(("127.0.0.1", ports[0]))
+    spoofed = next(i for i in range(1, 16) if (i - 1) % NODES == 2 and i not in local[2].ids)
+    fake.sendall(("09 2 %s\n03 %02d default\n" % (SECRET[:-1], spoofed)).encode())
+    time.sleep(0.3)
+    asker = Equipment(ports[0])
+    asker.request(asker.ids[0], spoofed)
+    refused = wait_until(lambda: ["%02d" % asker.ids[0], "%02d" % spoofed, TARGET_NOT_FOUND] in asker.errors, 2)
+    check(refused, "spoofed PEER_HELLO is not taken as node 2's link")
+    check(reach(requester, local[2].ids[0]), "node 2's real link still relays")
+    fake.close()
+
+    # node 1 and node 2 each stay under the limit, together they exceed what the target on node 0 may receive
+    first, second = requester, Equipment(ports[2])
+    target = Equipment(ports[0]).ids[0]
+    wait_until(lambda: reach(first, target) and reach(second, target))
+    start = time.time()
+    while time.time() - start < 4:
+        first.request(first.ids[0], target)
+        second.request(second.ids[0], target)
+        time.sleep(0.04)
+    throttled = lambda: sum(1 for e in first.errors + second.errors if e[-1] == RATE_LIMITED)
+    wait_until(lambda: throttled() > 0, 2)
+    print("requests to one target from two nodes: %d throttled by the target's node" % throttled())
+    check(throttled() > 0, "target's node applies the target rate limit")
+    # relayed or not, the error names the request's origin and target
+    expected = lambda equipment: [["%02d" % equipment.ids[0], "%02d" % target, RATE_LIMITED]]
+    check(all(e in expected(first) for e in first.errors) and all(e in expected(second) for e in second.errors), "throttled requests answered 07 <origin> <target> 05")
+
+    # node 2 goes down: its equipments are not found instead of silently dropped
+    servers[2].stop()
+    time.sleep(0.5)
+    requester.request(requester.ids[0], local[2].ids[0])
+    check(wait_until(lambda: ["%02d" % requester.ids[0], "%02d" % local[2].ids[0], TARGET_NOT_FOUND] in requester.errors, 2), "equipment of a node that is down is reported not found")
+    for server in servers:
+        server.stop()
+
+    # saturation, on a second federation of the build without rate limits
+    unlimited = unlimited or build_unlimited()
+    ports = [port + NODES + node for node in range(NODES)]
+    addresses = ["127.0.0.1:%d" % p for p in ports]
+    servers = [Server(unlimited, ports[node], "node", node, SECRET, *addresses) for node in range(NODES)]
+    # two origins on node 1, answered by equipments on node 1 (same node) or node 0 (across)
+    origins = [Equipment(ports[1]) for _ in range(2)]
+    same = [Equipment(ports[1]) for _ in range(2)]
+    across = [Equipment(ports[0]) for _ in range(2)]
+    wait_until(lambda: all(reach(o, a.ids[0]) for o, a in zip(origins, across)))
+    rate, lost = saturate(origins, [e.ids[0] for e in same])
+    print("%-28s %7.0f RES_INF/s  lost %d" % ("saturation same node", rate, lost))
+    check(lost == 0, "no response lost at saturation on the same node")
+    rate, lost = saturate(origins, [e.ids[0] for e in across])
+    print("%-28s %7.0f RES_INF/s  lost %d" % ("saturation across nodes", rate, lost))
+    check(lost == 0, "no response lost at saturation across nodes")
+finally:
+    for server in servers:
+        server.stop()
+
+sys.exit(1 if failures else 0)
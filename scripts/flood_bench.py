@@ -0,0 +1,55 @@
+"""Round trip latency of a REQ_INF/RES_INF between two well behaved equipments, alone and while another client floods the server.
+
+The flooder sends REQ_INF past the rate limits (to a bystander, the target limit would otherwise throttle the measured requests
+on purpose), RES_INF nobody asked for (to itself and to the measured requester) and never reads what the server writes back. It reconnects whenever the server disconnects it, so the flood lasts the whole run.
+
+Usage: python3 scripts/flood_bench.py [server binary] [port] [pings]
+"""
+import sys
+import threading
+import time
+
+from tp2 import Equipment, Server, latencies, report
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "./server"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 5151
+pings = int(sys.argv[3]) if len(sys.argv) > 3 else 100
+
+server = Server(binary, port)
+try:
+    requester = Equipment(port)
+    responder = Equipment(port)
+    bystander = Equipment(port)
+    origin, destination = requester.ids[0], responder.ids[0]
+
+    rounds, lost = latencies(requester, origin, destination, pings)
+    report("alone", rounds, lost)
+
+    stop = False
+    disconnections = [0]
+
+    def flood():
+        while not stop:
+            flooder = Equipment(port, respond=False)
+            flooder.stop_reading()
+            own = flooder.ids[0]
+            burst = ("05 %02d %02d\n" % (own, bystander.ids[0]) + "06 %02d %02d %s\n" % (own, own, "x" * 400) + "06 %02d %02d %s\n" % (own, origin, "x" * 400)) * 20
+            while not stop and not flooder.closed:
+                flooder.send(burst)
+            if flooder.closed:
+                disconnections[0] += 1
+            flooder.close()
+
+    thread = threading.Thread(target=flood, daemon=True)
+    thread.start()
+    time.sleep(1)
+    rounds, lost = latencies(requester, origin, destination, pings)
+    stop = True
+    thread.join()
+    report("while flooded", rounds, lost)
+
+    unsolicited = sum(1 for response in requester.responses if response[1] != destination)
+    print("flooder disconnected %d times, %d unsolicited RES_INF reached the requester" % (disconnections[0], unsolicited))
+    sys.exit(1 if lost > 0 or unsolicited > 0 else 0)
+finally:
+    server.stop()
@@ -0,0 +1,97 @@
+"""No message is lost across a handoff: a requester keeps sending REQ_INF to a responder while the server is replaced, and every one of them must be answered.
+
+A first handoff goes to a fake new server that takes the sockets but never acknowledges them, the running server must resume serving.
+A second one is acknowledged only after the running server stopped waiting: it must resume serving and never confirm the handoff.
+A third one goes to a real takeover, after which the old server must have exited and the new one carries on relaying.
+
+Usage: python3 scripts/handoff_test.py [server binary] [port] [requests]
+"""
+import array
+import socket
+import sys
+import threading
+import time
+
+from tp2 import Equipment, Server, wait_until
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "./server"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 5152
+count = int(sys.argv[3]) if len(sys.argv) > 3 else 90
+HANDOFF_TIMEOUT_SECONDS = 5
+# slow enough for the requests queued while a handoff waits for its acknowledgement to fit the rate limit burst
+INTERVAL = 0.2
+
+
+def fake_handoff(ack_after=None):
+    """Connect as a new server would and take the registry and the sockets, then hang up without acknowledging them
+    or acknowledge them after `ack_after` seconds. Returns the number of sockets received and the running server's answer to the acknowledgement."""
+    handoff = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    handoff.connect("/tmp/tp2-server-%d.handoff" % port)
+    fds = array.array("i")
+    _, ancillary, _, _ = handoff.recvmsg(4096, socket.CMSG_SPACE(64 * fds.itemsize))
+    for level, kind, data in ancillary:
+        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+            fds.frombytes(data[:len(data) - len(data) % fds.itemsize])
+    answer = None
+    if ack_after is not None:
+        time.sleep(ack_after)
+        handoff.settimeout(2)
+        answer = b""
+        try:
+            handoff.sendall(b"A")
+            # the rest of the registry, then the confirmation if any
+            while True:
+                data = handoff.recv(65536)
+                if not data:
+                    break
+                answer = data[-1:]
+        except (socket.timeout, ConnectionError):
+            # the running server hung up after giving up on the acknowledgement
+            pass
+    for fd in fds:
+        socket.close(fd)
+    handoff.close()
+    return len(fds), answer
+
+
+server = Server(binary, port)
+try:
+    requester = Equipment(port)
+    responder = Equipment(port)
+    origin, destination = requester.ids[0], responder.ids[0]
+
+    def send():
+        for _ in range(count):
+            requester.request(origin, destination)
+            time.sleep(INTERVAL)
+
+    thread = threading.Thread(target=send, daemon=True)
+    thread.start()
+
+    time.sleep(count * INTERVAL / 5)
+    received, _ = fake_handoff()
+    answered = len(requester.responses)
+    resumed = wait_until(lambda: len(requester.responses) > answered + 3) and server.processes[0].poll() is None
+    print("refused handoff: %d sockets received, old server %s" % (received, "resumed" if resumed else "did not resume"))
+
+    # the running server gave up waiting, the late acknowledgement must not make both servers serve
+    time.sleep(count * INTERVAL / 5)
+    received, answer = fake_handoff(HANDOFF_TIMEOUT_SECONDS + 0.5)
+    answered = len(requester.responses)
+    late = wait_until(lambda: len(requester.responses) > answered + 3) and server.processes[0].poll() is None and answer != b"C"
+    print("late acknowledgement: %d sockets received, %s, old server %s" % (received, "confirmed" if answer == b"C" else "not confirmed", "resumed" if late else "did not resume"))
+    resumed = resumed and late
+
+    time.sleep(count * INTERVAL / 5)
+    old = server.processes[0]
+    server.start("takeover")
+    exited = wait_until(lambda: old.poll() is not None)
+    print("takeover: old server %s" % ("exited" if exited else "is still running"))
+
+    thread.join()
+    wait_until(lambda: len(requester.responses) >= count)
+    answered = len(requester.responses)
+    print("%d REQ_INF sent, %d RES_INF received, %d errors" % (count, answered, len(requester.errors)))
+    sys.exit(0 if resumed and exited and answered == count and not requester.errors else 1)
+finally:
+    server.stop()
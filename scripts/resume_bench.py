@@ -0,0 +1,72 @@
+"""Recovery of a full server after a crash: the equipments resume their ids from the snapshot, compared with registering again from scratch.
+
+Gateways (several equipments per connection) take every id of the server, which is then killed and restarted on the same directory.
+Reported for each recovery: the time from the restart until every gateway has all its ids back, and the RES_ADD and REQ_REM frames
+the gateways received meanwhile. The fresh storm restarts without the snapshot, so every equipment registers again as a new one.
+
+Usage: python3 scripts/resume_bench.py [server binary] [port] [gateways]
+"""
+import os
+import sys
+import threading
+import time
+
+from tp2 import REQ_REM, RES_ADD, Equipment, Server, wait_until
+
+binary = sys.argv[1] if len(sys.argv) > 1 else "./server"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 5153
+gateways = int(sys.argv[3]) if len(sys.argv) > 3 else 3
+MAX_EQUIPMENTS = 15
+SNAPSHOT_INTERVAL_SECONDS = 5
+
+
+def recover(server, equipments, resume):
+    """Kill the server, restart it and reconnect every gateway at once. Returns the seconds until every id is back, None if some are not."""
+    server.stop()
+    wait_until(lambda: all(e.closed for e in equipments))
+    for equipment in equipments:
+        equipment.frames.clear()
+    if not resume:
+        os.remove(os.path.join(server.directory, "server-%d.snapshot" % port))
+    server.start()
+    start = time.perf_counter()
+    done = [None] * len(equipments)
+
+    def reconnect(index):
+        if equipments[index].reconnect(resume):
+            done[index] = time.perf_counter() - start
+
+    threads = [threading.Thread(target=reconnect, args=(i,)) for i in range(len(equipments))]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    # broadcasts about the last ids may still be on their way
+    time.sleep(0.5)
+    return None if None in done else max(done)
+
+
+def report(label, seconds, equipments):
+    frames = lambda message: sum(e.frames[message] for e in equipments)
+    elapsed = "%7.1fms" % (seconds * 1e3) if seconds is not None else "   not all back"
+    print("%-18s %s  RES_ADD %4d  REQ_REM %4d" % (label, elapsed, frames(RES_ADD), frames(REQ_REM)))
+
+
+server = Server(binary, port)
+try:
+    per_gateway = MAX_EQUIPMENTS // gateways
+    equipments = [Equipment(port, count=per_gateway) for _ in range(gateways)]
+    ids = sorted(i for e in equipments for i in e.ids)
+    print("%d gateways registered %d ids" % (gateways, len(ids)))
+    # every id must be on the snapshot before the crash
+    time.sleep(SNAPSHOT_INTERVAL_SECONDS + 1)
+
+    resumed = recover(server, equipments, True)
+    report("resume", resumed, equipments)
+    kept = sorted(i for e in equipments for i in e.ids) == ids
+
+    fresh = recover(server, equipments, False)
+    report("fresh storm", fresh, equipments)
+    sys.exit(0 if resumed is not None and kept and fresh is not None else 1)
+finally:
+    server.stop()
@@ -0,0 +1,189 @@
+"""Helpers shared by the test and benchmark scripts: start servers and drive equipments over the protocol."""
+import collections
+import os
+import socket
+import subprocess
+import tempfile
+import threading
+import time
+
+REQ_ADD, REQ_REM, RES_ADD, RES_LIST, REQ_INF, RES_INF, ERROR, OK = "01", "02", "03", "04", "05", "06", "07", "08"
+
+
+class Server:
+    """A server process, run on its own directory so its snapshot never leaks into another run."""
+
+    def __init__(self, binary, port, *args):
+        self.binary = os.path.abspath(binary)
+        self.port = port
+        self.directory = tempfile.mkdtemp(prefix="tp2-")
+        self.processes = []
+        self.start(*args)
+
+    def start(self, *args):
+        """Start the binary (again, e.g. to take over from the running one) and wait for it to accept connections."""
+        log = open(os.path.join(self.directory, "server-%d.log" % len(self.processes)), "w")
+        process = subprocess.Popen([self.binary, str(self.port)] + [str(a) for a in args], cwd=self.directory, stdout=log, stderr=subprocess.STDOUT)
+        self.processes.append(process)
+        if "takeover" not in args:
+            wait_port(self.port)
+        return process
+
+    def stop(self):
+        for process in self.processes:
+            if process.poll() is None:
+                process.kill()
+            process.wait()
+
+    def log(self, index=-1):
+        with open(os.path.join(self.directory, "server-%d.log" % (len(self.processes) + index if index < 0 else index))) as f:
+            return f.read()
+
+
+def wait_port(port, timeout=5):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port)).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    raise RuntimeError("server on port %d did not start" % port)
+
+
+class Equipment:
+    """A connection registering `count` equipments. It answers every REQ_INF and records when each RES_INF and ERROR arrives,
+    the resume token of each of its ids and how many frames of each message it received."""
+
+    def __init__(self, port, group="default", count=1, respond=True):
+        self.port = port
+        self.group = group
+        self.respond = respond
+        self.ids = []
+        self.tokens = {}
+        self.frames = collections.Counter()
+        self.responses = []
+        self.errors = []
+        self.requests = 0
+        self.reading = True
+        self.lock = threading.Lock()
+        self._connect()
+        self.send("".join("%s %s\n" % (REQ_ADD, group) for _ in range(count)))
+        wait_until(lambda: len(self.ids) == count)
+
+    def _connect(self):
+        self.sock = socket.create_connection(("127.0.0.1", self.port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.closed = False
+        threading.Thread(target=self._receive, args=(self.sock,), daemon=True).start()
+
+    def reconnect(self, resume=True, timeout=5):
+        """Connect again once the server went down and get the ids back: presenting their resume tokens, or registering as many new equipments.
+        Returns whether every id was given back (resuming) or a new one was given for each (registering)."""
+        previous = self.ids
+        self.ids = []
+        self._connect()
+        if resume:
+            self.send("".join("%s %s %02d %s\n" % (REQ_ADD, self.group, i, self.tokens[i]) for i in previous))
+            return wait_until(lambda: sorted(self.ids) == sorted(previous), timeout)
+        self.send("".join("%s %s\n" % (REQ_ADD, self.group) for _ in previous))
+        return wait_until(lambda: len(self.ids) == len(previous), timeout)
+
+    def send(self, data):
+        try:
+            self.sock.sendall(data.encode())
+        except OSError:
+            self.closed = True
+
+    def request(self, origin, destination):
+        self.send("%s %02d %02d\n" % (REQ_INF, origin, destination))
+
+    def _receive(self, sock):
+        pending = b""
+        while True:
+            if not self.reading:
+                time.sleep(0.1)
+                continue
+            try:
+                data = sock.recv(65536)
+            except OSError:
+                data = b""
+            if not data:
+                # a socket left behind by a reconnection does not close the new one
+                if sock is self.sock:
+                    self.closed = True
+                return
+            pending += data
+            while b"\n" in pending:
+                line, pending = pending.split(b"\n", 1)
+                self._handle(line.decode().split())
+
+    def _handle(self, tokens):
+        now = time.perf_counter()
+        with self.lock:
+            self.frames[tokens[0]] += 1
+        if tokens[0] == RES_ADD and len(tokens) == 3:
+            self.tokens[int(tokens[1])] = tokens[2]
+            self.ids.append(int(tokens[1]))
+        elif tokens[0] == REQ_INF:
+            with self.lock:
+                self.requests += 1
+            if self.respond:
+                self.send("%s %s %s 1.00\n" % (RES_INF, tokens[2], tokens[1]))
+        elif tokens[0] == RES_INF:
+            with self.lock:
+                self.responses.append((now, int(tokens[1]), int(tokens[2])))
+        elif tokens[0] == ERROR:
+            with self.lock:
+                self.errors.append(tokens[1:])
+
+    def stop_reading(self):
+        """Stop taking bytes from the server, as a stuck client would."""
+        self.reading = False
+
+    def close(self):
+        self.sock.close()
+
+
+def wait_until(condition, timeout=5):
+    deadline = time.time() + timeout
+    while not condition():
+        if time.time() > deadline:
+            return False
+        time.sleep(0.0005)
+    return True
+
+
+def ping(requester, origin, destination, timeout=2):
+    """Send a REQ_INF and wait for its RES_INF, returning the round trip in microseconds (None if it did not come back)."""
+    count = len(requester.responses)
+    start = time.perf_counter()
+    requester.request(origin, destination)
+    if not wait_until(lambda: len(requester.responses) > count, timeout):
+        return None
+    return (requester.responses[count][0] - start) * 1e6
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def latencies(requester, origin, destination, count, interval=0.06):
+    """Ping `count` times, paced under the rate limit. Returns the round trips and how many were lost."""
+    rounds, lost = [], 0
+    for _ in range(count):
+        rtt = ping(requester, origin, destination)
+        if rtt is None:
+            lost += 1
+        else:
+            rounds.append(rtt)
+        time.sleep(interval)
+    return rounds, lost
+
+
+def report(label, rounds, lost):
+    if not rounds:
+        print("%-28s every round trip lost (%d)" % (label, lost))
+        return
+    print("%-28s p50 %7.0fus  p99 %7.0fus  max %7.0fus  lost %d" % (label, percentile(rounds, 0.5), percentile(rounds, 0.99), max(rounds), lost))
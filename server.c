@@ -8,9 +8,11 @@
 #include <unistd.h>
 #include "common.h"
 #include <arpa/inet.h>
-
-/// The number of position allocated to the split array of a message
-#define MAX_TOKENS 20
+#include <time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
 /// Valid equipment id range
 #define EQUIPMENT_RANGE_FROM 1
@@ -19,25 +21,276 @@
 /// Indicates the _sendMessage destinationEqId should be used to find the socket id
 #define DESTINATION_EQ_ID -1
 
+/// Token bucket refill rate (requests per second) and burst size, applied to each origin and to each target of a REQ_INF
+/// (may be set at build time, e.g. out of reach to measure how many messages the server relays)
+#ifndef RATE_LIMIT_PER_SECOND
+#define RATE_LIMIT_PER_SECOND 20.0
+#endif
+#ifndef RATE_LIMIT_BURST
+#define RATE_LIMIT_BURST 40.0
+#endif
+
+/// Bytes a data lane may write on each deficit round robin turn
+#define SCHEDULER_QUANTUM MAX_BYTES
+
+/// Maximum bytes of a single write, frames waiting for the same connection are batched up to it
+#define MAX_BATCH_BYTES 4096
+
+/// Bytes that may wait for a socket that is not taking them, a client whose output grows past it is disconnected
+#define MAX_OUTPUT_BYTES 65536
+
+/// Sockets are written without blocking, the ones with bytes waiting are polled (socket ids must be below it)
+#define MAX_SOCKETS 1024
+
+/// Seconds a handoff waits for the clients to take the bytes still waiting for them
+#define HANDOFF_FLUSH_SECONDS 2
+
+/// File the registry is periodically saved to (one per port, so several nodes can run on the same directory), so a restarted server can resume the sessions of its equipments
+#define SNAPSHOT_FILE "server-%d.snapshot"
+#define SNAPSHOT_INTERVAL_SECONDS 5
+
+/// How long an id loaded from the snapshot is held for its equipment to resume it
+#define RESUME_GRACE_SECONDS 30
+
+/// Unix socket (one per port) a new server binary connects to in order to take over the sockets and the registry of the running one
+#define HANDOFF_SOCKET_PATH "/tmp/tp2-server-%d.handoff"
+
+/// Argument that starts the server taking over from the running one instead of binding the port
+#define TAKEOVER_ARGUMENT "takeover"
+
+/// Version of the registry sent on a handoff, to be increased whenever handoffState or the handoff exchange changes
+#define HANDOFF_VERSION 3
+
+/// Byte the new server answers once it took everything over, and how long the running server waits for it before resuming
+#define HANDOFF_ACK 'A'
+#define HANDOFF_TIMEOUT_SECONDS 5
+
+/// Byte the running server answers to an acknowledgement received in time, the new server only serves once it got it
+#define HANDOFF_CONFIRM 'C'
+
+/// Maximum number of federated servers (nodes), and the argument followed by this node's index, the federation's secret and the address of every node
+#define MAX_NODES 8
+#define NODE_ARGUMENT "node"
+
+/// Seconds between the attempts to (re)connect the link to a peer node
+#define PEER_RETRY_SECONDS 1
+
+/// Seconds an attempt waits for a peer node to accept the link, a handoff waits for the attempt to end
+#define PEER_CONNECT_TIMEOUT_SECONDS 2
+
 struct threadArgs {
 	int sockId;
 	int threadId;
 };
 typedef struct threadArgs threadArgs;
 
+/// Token bucket used to throttle the REQ_INF traffic of an equipment
+struct tokenBucket {
+	double tokens;
+	struct timespec lastRefill;
+};
+typedef struct tokenBucket tokenBucket;
+
+/// A message waiting on the scheduler to be written to a socket
+struct frame {
+	int sockId;
+	bool closeAfter;
+	size_t length;
+	char message[MAX_BYTES];
+	struct frame *next;
+};
+typedef struct frame frame;
+
+/// FIFO of frames waiting to be written
+struct frameQueue {
+	frame *head;
+	frame *tail;
+};
+typedef struct frameQueue frameQueue;
+
+/// Bytes a socket could not take yet, written as soon as it is writable again
+struct output {
+	size_t length;
+	bool dropped;
+	char data[MAX_OUTPUT_BYTES];
+};
+typedef struct output output;
+
+/// Frames collected for a socket on a scheduling round, written to it at once whatever lanes they came from
+struct batch {
+	int sockId;
+	bool closeAfter;
+	size_t length;
+	char data[MAX_BATCH_BYTES];
+};
+typedef struct batch batch;
+
+/// A named set of equipments, membership events and group queries are only fanned out to its members
+struct group {
+	char name[MAX_GROUP_NAME];
+	int members[MAX_EQUIPMENTS];
+	int memberCount;
+};
+typedef struct group group;
+
+/// Local state of a connection thread, saved when the thread is cancelled for a handoff
+struct connectionBuffer {
+	int connection;
+	char *buffer;
+	size_t *pending;
+};
+typedef struct connectionBuffer connectionBuffer;
+
+/// Sent ahead of the registry on a handoff, the new server only takes over a registry of its own version and size
+struct handoffHeader {
+	int version;
+	size_t length;
+};
+typedef struct handoffHeader handoffHeader;
+
+/// Registry sent to the new server on a handoff, along with the listening and client sockets
+struct handoffState {
+	bool equipments[MAX_EQUIPMENTS + 1];
+	bool busyThreads[MAX_EQUIPMENTS + 1];
+	int equipmentConnections[MAX_EQUIPMENTS + 1];
+	bool restoredEquipments[MAX_EQUIPMENTS + 1];
+	time_t reservedUntil[MAX_EQUIPMENTS + 1];
+	char resumeTokens[MAX_EQUIPMENTS + 1][RESUME_TOKEN_SIZE];
+	char groupNames[MAX_EQUIPMENTS + 1][MAX_GROUP_NAME];
+	size_t pendingLengths[MAX_EQUIPMENTS + 1];
+	char pendingBuffers[MAX_EQUIPMENTS + 1][MAX_BYTES];
+	int connectionNodes[MAX_EQUIPMENTS + 1];
+	int nodeConnections[MAX_NODES];
+	int pendingRequests[MAX_EQUIPMENTS + 1][MAX_EQUIPMENTS + 1];
+};
+typedef struct handoffState handoffState;
+
 /// Array to hold the equipments that have been connected and accepted into the network
 bool equipments[MAX_EQUIPMENTS + 1];
 
-/// Array of threads to refence the current created threads
+/// Array of threads to refence the current created threads (one per connection)
 pthread_t threads[MAX_EQUIPMENTS + 1];
 
 /// Array that holds which position is available for a new thread/connection and which are busy
 bool busyThreads[MAX_EQUIPMENTS + 1];
 
-/// Maps a thread/equipment id to a socket id
+/// Maps a thread/connection to its socket id
+int connectionSockets[MAX_EQUIPMENTS + 1];
+
+/// Maps an equipment id to the thread/connection it was registered on (-1 if it is not registered), a connection may register several equipments
+int equipmentConnections[MAX_EQUIPMENTS + 1];
+
+/// Maps an equipment id to the socket id of its connection
 int threadSocketsMap[MAX_EQUIPMENTS + 1];
 
-/// Find the first id that is not in use (if none is available, return -1)
+/// Token an equipment presents on REQ_ADD to get its id back after a server restart
+char resumeTokens[MAX_EQUIPMENTS + 1][RESUME_TOKEN_SIZE];
+
+/// Time until which an id loaded from the snapshot is held for its equipment (0 if it is not held)
+time_t reservedUntil[MAX_EQUIPMENTS + 1];
+
+/// Equipments that were part of the fleet saved on the snapshot, and therefore already know its membership
+bool restoredEquipments[MAX_EQUIPMENTS + 1];
+
+/// The groups that have members (including ids held for resuming equipments), each with its precomputed member list
+group groups[MAX_EQUIPMENTS];
+
+/// Maps an equipment id to the index of its group on groups (-1 if it is in none)
+int equipmentGroups[MAX_EQUIPMENTS + 1];
+pthread_mutex_t groupsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Bytes of an incomplete message of each connection, handed between the old and the new server
+size_t pendingLengths[MAX_EQUIPMENTS + 1];
+char pendingBuffers[MAX_EQUIPMENTS + 1][MAX_BYTES];
+
+/// The listening socket and the thread accepting connections on it
+int serverSocket;
+pthread_t acceptThread;
+
+/// Path of this server's snapshot file
+char snapshotPath[MAX_BYTES];
+
+/// Held while the snapshot thread releases expired ids and saves the registry, and by a handoff from the flush until the registry was handed over
+pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// This server's position on the federation and the number of nodes in it, the equipment ids are partitioned across the nodes
+int nodeIndex = 0;
+int nodeCount = 1;
+
+/// Address of each node of the federation
+struct sockaddr_in nodeAddresses[MAX_NODES];
+
+/// Secret shared by the nodes of the federation, a link is only taken as a node's once its PEER_HELLO presents it
+char nodeSecret[MAX_BYTES];
+
+/// Socket of the link to each peer node (-1 while it is down), the messages for the equipments attached to that node are written to it.
+/// There is one link per pair of nodes, opened by the node with the higher index, whose thread keeps reopening it.
+int peerSockets[MAX_NODES];
+pthread_t peerThreads[MAX_NODES];
+
+/// Maps a thread/connection to the peer node on its other end (-1 for a connection of equipments)
+int connectionNodes[MAX_EQUIPMENTS + 1];
+
+/// The thread/connection of the current link to each peer node (-1 while it is down), only its messages are handled and only its loss removes the node's equipments
+int nodeConnections[MAX_NODES];
+
+/// Held from the check that an id is free (or held for a resuming equipment) until it is taken, connection threads register equipments at the same time
+pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Held while a thread/connection slot is picked and taken, connections are accepted and links to peers opened at the same time
+pthread_mutex_t slotsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Buckets limiting how many REQ_INF each equipment can send (origin) and receive (target)
+tokenBucket originBuckets[MAX_EQUIPMENTS + 1];
+tokenBucket targetBuckets[MAX_EQUIPMENTS + 1];
+
+/// Buckets limiting how many errors each thread/connection is answered, so a client flooding invalid requests cannot fill the control lane
+tokenBucket errorBuckets[MAX_EQUIPMENTS + 1];
+
+/// REQ_INF forwarded to each equipment (first index) from each requester (second index) and not answered yet, a RES_INF is only relayed as the answer to one of them
+int pendingRequests[MAX_EQUIPMENTS + 1][MAX_EQUIPMENTS + 1];
+pthread_mutex_t bucketsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Priority lane for control messages (RES_ADD, RES_LIST, REQ_REM, OK, ERROR), always written before any data message
+frameQueue controlLane;
+
+/// Data lanes (REQ_INF, RES_INF) of each origin equipment, served with deficit round robin
+frameQueue dataLanes[MAX_EQUIPMENTS + 1];
+int deficits[MAX_EQUIPMENTS + 1];
+
+/// The data lane being served and whether its quantum was already granted for this turn
+int currentLane = 1;
+bool laneTurnStarted = false;
+
+/// Frames queued or being written, a handoff waits for it to reach zero
+int queuedFrames = 0;
+
+/// Batches of the scheduling round being collected (one per socket, every connection and peer link may have one)
+#define MAX_ROUND_BATCHES (MAX_EQUIPMENTS + MAX_NODES + 1)
+batch roundBatches[MAX_ROUND_BATCHES];
+
+/// Output of each socket (NULL until it could not take a write), only the scheduler writes and frees them
+output *outputs[MAX_SOCKETS];
+
+/// Bytes waiting on the outputs, a handoff also waits for it to reach zero
+size_t outputBytes = 0;
+
+/// Pipe that wakes the scheduler up while it polls the sockets with waiting bytes, and whether it is polling them
+int wakePipe[2];
+bool schedulerPolling = false;
+
+/// Set by a handoff that could not wait any longer for the sockets with waiting bytes, which are then disconnected
+bool dropOutputs = false;
+
+pthread_mutex_t schedulerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t schedulerCond = PTHREAD_COND_INITIALIZER;
+
+/// Whether an id is being held for the equipment that owned it before the server restarted
+bool _isReserved(int equipId) {
+	return reservedUntil[equipId] > time(NULL);
+}
+
+/// Find the first thread/connection position that is not in use (if none is available, return -1)
 int threadId() {
 	int i;
 	for(i = 1; i < MAX_EQUIPMENTS + 1; i++) {
@@ -48,12 +301,494 @@ int threadId() {
 	return -1;
 }
 
+/// The node an equipment id belongs to, the ids are dealt round robin across the nodes so two nodes never hand out the same one
+int _ownerNode(int equipId) {
+	return (equipId - EQUIPMENT_RANGE_FROM) % nodeCount;
+}
+
+/// Whether an equipment id is registered and attached to the given node
+bool _isNodeEquipment(int equipId, int node) {
+	return equipId >= EQUIPMENT_RANGE_FROM && equipId <= MAX_EQUIPMENTS && equipments[equipId] && _ownerNode(equipId) == node;
+}
+
+/// Whether messages can reach a registered equipment: it is attached to this node, or the link to its node is up
+bool _isReachable(int equipId) {
+	return equipments[equipId] && (_ownerNode(equipId) == nodeIndex || peerSockets[_ownerNode(equipId)] != -1);
+}
+
+/// Find the first equipment id of this node that is neither registered nor held for a resuming equipment (if none is available, return -1)
+int _freeEquipmentId() {
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(_ownerNode(i) == nodeIndex && !equipments[i] && !_isReserved(i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Bind an equipment id to the connection that registered it, so messages to the id are routed to that connection
+ * 
+ * @param equipId : the equipment id
+ * @param connection : the thread/connection that registered it
+ */
+void _bindEquipment(int equipId, int connection) {
+	equipmentConnections[equipId] = connection;
+	threadSocketsMap[equipId] = connectionSockets[connection];
+}
+
+/**
+ * Take a free equipment id of this node for a connection: the id is registered and bound before any other connection can look for a free one
+ * 
+ * @param connection : the thread/connection registering an equipment
+ * @return the id taken, -1 if none is available
+ */
+int _takeEquipmentId(int connection) {
+	pthread_mutex_lock(&registryLock);
+	int equipId = _freeEquipmentId();
+	if(equipId != -1) {
+		_bindEquipment(equipId, connection);
+		equipments[equipId] = true;
+	}
+	pthread_mutex_unlock(&registryLock);
+	return equipId;
+}
+
+/// Count the equipments registered on a connection
+int _connectionEquipmentCount(int connection) {
+	int count = 0;
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(equipments[i] && equipmentConnections[i] == connection) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/**
+ * Refill a bucket with the tokens accumulated since its last refill
+ * 
+ * @param bucket : the bucket to refill
+ * @param now : the current time (CLOCK_MONOTONIC)
+ */
+void _refillBucket(tokenBucket *bucket, struct timespec now) {
+	double elapsed = (now.tv_sec - bucket->lastRefill.tv_sec) + (now.tv_nsec - bucket->lastRefill.tv_nsec) / 1e9;
+	bucket->tokens += elapsed * RATE_LIMIT_PER_SECOND;
+	if(bucket->tokens > RATE_LIMIT_BURST) {
+		bucket->tokens = RATE_LIMIT_BURST;
+	}
+	bucket->lastRefill = now;
+}
+
+/// Fill a bucket up to its burst (bucketsLock must be held)
+void _fillBucket(tokenBucket *bucket) {
+	clock_gettime(CLOCK_MONOTONIC, &bucket->lastRefill);
+	bucket->tokens = RATE_LIMIT_BURST;
+}
+
+/// Fill the buckets of an equipment and forget the requests pending to and from its id, so a newly added equipment starts afresh
+void _resetBuckets(int equipId) {
+	pthread_mutex_lock(&bucketsLock);
+	_fillBucket(&originBuckets[equipId]);
+	_fillBucket(&targetBuckets[equipId]);
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		pendingRequests[equipId][i] = 0;
+		pendingRequests[i][equipId] = 0;
+	}
+	pthread_mutex_unlock(&bucketsLock);
+}
+
+/**
+ * Check whether a request from originEqId to destinationEqId fits both buckets, consuming one token of each if it does
+ * 
+ * @param originEqId : the equipment sending the request
+ * @param destinationEqId : the equipment the request is addressed to
+ * @return true if the request can be forwarded, false if it should be throttled
+ */
+bool _allowRequest(int originEqId, int destinationEqId) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&bucketsLock);
+	_refillBucket(&originBuckets[originEqId], now);
+	_refillBucket(&targetBuckets[destinationEqId], now);
+
+	bool allowed = originBuckets[originEqId].tokens >= 1 && targetBuckets[destinationEqId].tokens >= 1;
+	if(allowed) {
+		originBuckets[originEqId].tokens -= 1;
+		targetBuckets[destinationEqId].tokens -= 1;
+	}
+	pthread_mutex_unlock(&bucketsLock);
+	return allowed;
+}
+
 /// Init the equipments without any sensors
 void _initEquipments() {
 	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
 		equipments[i] = false;
 		busyThreads[i] = false;
+		equipmentConnections[i] = -1;
+		equipmentGroups[i] = -1;
+		connectionNodes[i] = -1;
+		_resetBuckets(i);
+	}
+	for(int node = 0; node < MAX_NODES; node++) {
+		peerSockets[node] = -1;
+		nodeConnections[node] = -1;
+	}
+}
+
+/// Whether a message type is data (REQ_INF, RES_INF) and therefore scheduled on its origin's lane
+bool _isDataMessage(char* idMsg) {
+	return strcmp(idMsg, REQ_INF) == 0 || strcmp(idMsg, RES_INF) == 0;
+}
+
+/**
+ * Append a frame to a lane and wake up the scheduler
+ * 
+ * @param lane : the lane the frame will wait on
+ * @param sockId : the socket the frame will be written to
+ * @param message : the encoded message (may be empty when closeAfter is set)
+ * @param closeAfter : whether the socket should be closed when the frame is reached
+ */
+void _enqueueFrame(frameQueue *lane, int sockId, char* message, bool closeAfter) {
+	frame *f = malloc(sizeof(frame));
+	f->sockId = sockId;
+	f->closeAfter = closeAfter;
+	f->length = strlen(message);
+	memcpy(f->message, message, f->length);
+	f->next = NULL;
+
+	pthread_mutex_lock(&schedulerLock);
+	if(lane->tail == NULL) {
+		lane->head = f;
+	} else {
+		lane->tail->next = f;
+	}
+	lane->tail = f;
+	queuedFrames++;
+	pthread_cond_signal(&schedulerCond);
+	if(schedulerPolling) {
+		write(wakePipe[1], "", 1);
+	}
+	pthread_mutex_unlock(&schedulerLock);
+}
+
+/// Remove the first frame of a lane (schedulerLock must be held)
+frame *_popFrame(frameQueue *lane) {
+	frame *f = lane->head;
+	lane->head = f->next;
+	if(lane->head == NULL) {
+		lane->tail = NULL;
+	}
+	return f;
+}
+
+/// Close a socket once every control message queued before it was written
+void _closeAfterFlush(int sockId) {
+	_enqueueFrame(&controlLane, sockId, "", true);
+}
+
+/// Drop the data frames still waiting to be written to a socket that is being closed (schedulerLock must be held)
+void _dropDataFrames(int sockId) {
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		frameQueue kept = { NULL, NULL };
+		while(dataLanes[i].head != NULL) {
+			frame *f = _popFrame(&dataLanes[i]);
+			if(f->sockId == sockId) {
+				free(f);
+				queuedFrames--;
+				continue;
+			}
+			f->next = NULL;
+			if(kept.tail == NULL) kept.head = f; else kept.tail->next = f;
+			kept.tail = f;
+		}
+		dataLanes[i] = kept;
+	}
+}
+
+/// Whether any data lane has frames waiting (schedulerLock must be held)
+bool _hasDataFrames() {
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(dataLanes[i].head != NULL) return true;
+	}
+	return false;
+}
+
+/// Put a frame back at the head of the lane it was taken from (schedulerLock must be held)
+void _pushBackFrame(frameQueue *lane, frame *f) {
+	f->next = lane->head;
+	lane->head = f;
+	if(lane->tail == NULL) {
+		lane->tail = f;
+	}
+}
+
+/**
+ * Append a frame to the batch of its socket on the current round (schedulerLock must be held)
+ * 
+ * @param f : the frame
+ * @param count : the number of batches of the round, updated when the frame opens a new one
+ * @return true if the frame joined a batch, false if the round is over (its socket's batch is full or closing, or there are no batches left)
+ */
+bool _batchFrame(frame *f, int *count) {
+	batch *b = NULL;
+	for(int i = 0; i < *count; i++) {
+		if(roundBatches[i].sockId == f->sockId) {
+			b = &roundBatches[i];
+			break;
+		}
+	}
+	if(b == NULL) {
+		if(*count == MAX_ROUND_BATCHES) {
+			return false;
+		}
+		b = &roundBatches[(*count)++];
+		b->sockId = f->sockId;
+		b->closeAfter = false;
+		b->length = 0;
+	}
+	if(b->closeAfter || b->length + f->length > MAX_BATCH_BYTES) {
+		return false;
+	}
+	if(f->closeAfter) {
+		// what was batched for the socket is still written, the rest of its data frames are not
+		b->closeAfter = true;
+		_dropDataFrames(f->sockId);
+	}
+	memcpy(b->data + b->length, f->message, f->length);
+	b->length += f->length;
+	return true;
+}
+
+/// Pick the next data frame with deficit round robin across the origin lanes (schedulerLock must be held and a data frame must exist)
+frame *_nextDataFrame() {
+	while(true) {
+		frameQueue *lane = &dataLanes[currentLane];
+		if(lane->head != NULL) {
+			if(!laneTurnStarted) {
+				deficits[currentLane] += SCHEDULER_QUANTUM;
+				laneTurnStarted = true;
+			}
+			if(lane->head->length <= deficits[currentLane]) {
+				deficits[currentLane] -= lane->head->length;
+				return _popFrame(lane);
+			}
+		} else {
+			deficits[currentLane] = 0;
+		}
+		currentLane = currentLane % MAX_EQUIPMENTS + 1;
+		laneTurnStarted = false;
+	}
+}
+
+/// Update the bytes waiting on an output (schedulerLock must not be held)
+void _setOutputLength(output *o, size_t length) {
+	pthread_mutex_lock(&schedulerLock);
+	outputBytes = outputBytes - o->length + length;
+	pthread_mutex_unlock(&schedulerLock);
+	o->length = length;
+}
+
+/**
+ * Give up on a socket that stopped taking its bytes (or broke): what is waiting for it is dropped, as is everything written to it until it is closed.
+ * Its connection thread then sees the connection end and removes its equipments.
+ *
+ * @param sockId : the socket
+ */
+void _dropOutput(int sockId) {
+	output *o = outputs[sockId];
+	_setOutputLength(o, 0);
+	if(!o->dropped) {
+		o->dropped = true;
+		shutdown(sockId, SHUT_RDWR);
+	}
+}
+
+/**
+ * Write the bytes waiting for a socket that became writable
+ *
+ * @param sockId : the socket
+ */
+void _flushOutput(int sockId) {
+	output *o = outputs[sockId];
+	ssize_t sent = send(sockId, o->data, o->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(sent < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			_dropOutput(sockId);
+		}
+		return;
+	}
+	memmove(o->data, o->data + sent, o->length - sent);
+	_setOutputLength(o, o->length - sent);
+}
+
+/**
+ * Write bytes to a socket without blocking. What the socket does not take is kept on its output, behind the bytes already waiting there.
+ *
+ * @param sockId : the socket
+ * @param data : the bytes to write
+ * @param length : the number of bytes
+ */
+void _writeOutput(int sockId, char *data, size_t length) {
+	if(sockId < 0 || sockId >= MAX_SOCKETS) {
+		return;
+	}
+	output *o = outputs[sockId];
+	if(o != NULL && o->dropped) {
+		return;
+	}
+
+	// the bytes already waiting go first, the socket may have taken them since the last poll
+	if(o != NULL && o->length > 0) {
+		_flushOutput(sockId);
+		if(o->dropped) {
+			return;
+		}
+	}
+
+	size_t written = 0;
+	if(o == NULL || o->length == 0) {
+		ssize_t sent = send(sockId, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			// the connection broke, its thread notices it
+			return;
+		}
+		written = sent < 0 ? 0 : sent;
+	}
+	if(written == length) {
+		return;
+	}
+
+	if(o == NULL) {
+		o = outputs[sockId] = calloc(1, sizeof(output));
+	}
+	if(o->length + length - written > MAX_OUTPUT_BYTES) {
+		printf("Socket %d is not reading, disconnecting it\n", sockId);
+		_dropOutput(sockId);
+		return;
+	}
+	memcpy(o->data + o->length, data + written, length - written);
+	_setOutputLength(o, o->length + length - written);
+}
+
+/// Close a socket and forget its output
+void _closeOutput(int sockId) {
+	if(sockId >= 0 && sockId < MAX_SOCKETS && outputs[sockId] != NULL) {
+		// a last try for the bytes still waiting, the socket is closed either way
+		if(!outputs[sockId]->dropped && outputs[sockId]->length > 0) {
+			_flushOutput(sockId);
+		}
+		_setOutputLength(outputs[sockId], 0);
+		free(outputs[sockId]);
+		outputs[sockId] = NULL;
+	}
+	close(sockId);
+}
+
+/**
+ * Wait until a socket with waiting bytes is writable (and write them) or a frame is queued (schedulerLock must be held, it is released while waiting)
+ */
+void _pollOutputs() {
+	struct pollfd fds[MAX_SOCKETS + 1];
+	int count = 0;
+	fds[count].fd = wakePipe[0];
+	fds[count++].events = POLLIN;
+	for(int i = 0; i < MAX_SOCKETS; i++) {
+		if(outputs[i] != NULL && outputs[i]->length > 0) {
+			fds[count].fd = i;
+			fds[count++].events = POLLOUT;
+		}
+	}
+	schedulerPolling = true;
+	pthread_mutex_unlock(&schedulerLock);
+
+	poll(fds, count, -1);
+	char wake[64];
+	while(read(wakePipe[0], wake, sizeof(wake)) > 0);
+	for(int i = 1; i < count; i++) {
+		if(dropOutputs) {
+			_dropOutput(fds[i].fd);
+		} else if(fds[i].revents != 0) {
+			_flushOutput(fds[i].fd);
+		}
+	}
+
+	pthread_mutex_lock(&schedulerLock);
+	schedulerPolling = false;
+}
+
+/**
+ * Collect the frames of a scheduling round in one batch per socket: the control lane first, then the data lanes with deficit round robin.
+ * The round is over once every frame was taken or one does not fit its socket's batch (schedulerLock must be held).
+ * 
+ * @return the number of batches of the round
+ */
+int _collectRound() {
+	int count = 0;
+	while(controlLane.head != NULL) {
+		frame *f = _popFrame(&controlLane);
+		if(!_batchFrame(f, &count)) {
+			_pushBackFrame(&controlLane, f);
+			return count;
+		}
+		free(f);
+		queuedFrames--;
+	}
+	while(_hasDataFrames()) {
+		frame *f = _nextDataFrame();
+		if(!_batchFrame(f, &count)) {
+			// the lane is not charged for a frame that waits for the next round
+			deficits[currentLane] += f->length;
+			_pushBackFrame(&dataLanes[currentLane], f);
+			return count;
+		}
+		free(f);
+		queuedFrames--;
 	}
+	return count;
+}
+
+/**
+ * Thread that writes the queued frames, draining the control lane before the data lanes.
+ * Each round collects the frames going to the same connection (e.g. the equipments of a gateway, or a peer node's link) in a single write, whatever lanes they were queued on.
+ * Writes never block: a socket that is not taking its bytes keeps them on its (bounded) output, so it never holds back the others.
+ * 
+ * @param arg : unused
+ */
+void *threadScheduler(void *arg) {
+	pthread_mutex_lock(&schedulerLock);
+	while(true) {
+		while(controlLane.head == NULL && !_hasDataFrames()) {
+			if(outputBytes > 0) {
+				_pollOutputs();
+			} else {
+				pthread_cond_wait(&schedulerCond, &schedulerLock);
+			}
+		}
+
+		// the frames stay counted until they are written, so a handoff waits for them
+		int before = queuedFrames;
+		int count = _collectRound();
+		int collected = before - queuedFrames;
+		queuedFrames = before;
+		pthread_mutex_unlock(&schedulerLock);
+
+		for(int i = 0; i < count; i++) {
+			if(roundBatches[i].length > 0) {
+				_writeOutput(roundBatches[i].sockId, roundBatches[i].data, roundBatches[i].length);
+			}
+			if(roundBatches[i].closeAfter) {
+				_closeOutput(roundBatches[i].sockId);
+			}
+		}
+
+		pthread_mutex_lock(&schedulerLock);
+		queuedFrames -= collected;
+	}
+	int* returnMessage;
+	return returnMessage;
 }
 
 
@@ -68,148 +803,744 @@ void _sendMessage(char* idMsg, int originEqId, int destinationEqId, char* payloa
 	char message[MAX_BYTES] = { 0 };
 	sprintf(message, "%s", idMsg);
 
-	if(strcmp(idMsg, REQ_REM) == 0 || strcmp(idMsg, REQ_INF) == 0 || strcmp(idMsg, RES_INF) == 0) {
+	// An ERROR carries the ids of the message it answers (07 [<origin> [<destination>]] <code>), -1 for the ones it has none of
+	if(strcmp(idMsg, REQ_REM) == 0 || strcmp(idMsg, REQ_INF) == 0 || strcmp(idMsg, RES_INF) == 0 || (strcmp(idMsg, ERROR) == 0 && originEqId >= 0)) {
 		sprintf(message, "%s %s%d", message, originEqId < 10 ? "0" : "", originEqId);
 	}
 
-	if(strcmp(idMsg, REQ_INF) == 0 || strcmp(idMsg, RES_INF) == 0 || (strcmp(idMsg, ERROR) == 0 && strcmp(payload, ERR_EQUIPMENT_LIMIT_EXCEEDED) != 0) || strcmp(idMsg, OK) == 0) {
+	if(strcmp(idMsg, REQ_INF) == 0 || strcmp(idMsg, RES_INF) == 0 || (strcmp(idMsg, ERROR) == 0 && originEqId >= 0 && destinationEqId >= 0) || strcmp(idMsg, OK) == 0) {
 		sprintf(message, "%s %s%d", message, destinationEqId < 10 ? "0" : "", destinationEqId);
 	}
 
-	if(strcmp(idMsg, RES_ADD) == 0 || strcmp(idMsg, RES_LIST) == 0 || strcmp(idMsg, RES_INF) == 0 || strcmp(idMsg, ERROR) == 0 || strcmp(idMsg, OK) == 0) {
+	if(strcmp(idMsg, RES_ADD) == 0 || strcmp(idMsg, RES_LIST) == 0 || strcmp(idMsg, RES_INF) == 0 || strcmp(idMsg, ERROR) == 0 || strcmp(idMsg, OK) == 0 || strcmp(idMsg, PEER_HELLO) == 0) {
 		sprintf(message, "%s %s", message, payload);
 	}
 	sprintf(message, "%s\n", message);
-	send(destinationId == DESTINATION_EQ_ID ?  threadSocketsMap[destinationEqId] : destinationId, message, strlen(message), 0);
+
+	int sockId = destinationId == DESTINATION_EQ_ID ?  threadSocketsMap[destinationEqId] : destinationId;
+	_enqueueFrame(_isDataMessage(idMsg) ? &dataLanes[originEqId] : &controlLane, sockId, message, false);
+}
+
+/**
+ * Answer a request of a connection with an error, unless the connection already used up its share of errors (the error is then dropped).
+ * Errors are control messages, written before any data message, so a flood of invalid requests must not turn into a flood of errors.
+ * 
+ * @param connection : the thread/connection that sent the request
+ * @param originEqId : the origin equipment id of the request (-1 if it has none)
+ * @param destinationEqId : the destination equipment id of the request (-1 if it has none)
+ * @param error : the error code
+ */
+void _sendError(int connection, int originEqId, int destinationEqId, char* error) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&bucketsLock);
+	_refillBucket(&errorBuckets[connection], now);
+	bool allowed = errorBuckets[connection].tokens >= 1;
+	if(allowed) {
+		errorBuckets[connection].tokens -= 1;
+	}
+	pthread_mutex_unlock(&bucketsLock);
+
+	if(allowed) {
+		_sendMessage(ERROR, originEqId, destinationEqId, error, connectionSockets[connection]);
+	}
+}
+
+/**
+ * Forward a REQ_INF, remembering it is pending when it goes to an equipment of this node (which answers it here)
+ * 
+ * @param originEqId : the equipment that requested the information
+ * @param destinationEqId : the equipment the information is requested from
+ */
+void _forwardRequest(int originEqId, int destinationEqId) {
+	if(_ownerNode(destinationEqId) == nodeIndex) {
+		pthread_mutex_lock(&bucketsLock);
+		pendingRequests[destinationEqId][originEqId]++;
+		pthread_mutex_unlock(&bucketsLock);
+	}
+	_sendMessage(REQ_INF, originEqId, destinationEqId, "", DESTINATION_EQ_ID);
+}
+
+/**
+ * Check whether a RES_INF answers a pending REQ_INF, which it then no longer is
+ * 
+ * @param originEqId : the equipment that is responding
+ * @param destinationEqId : the equipment that requested the information
+ * @return true if the response can be relayed, false if nothing was requested from originEqId by destinationEqId
+ */
+bool _answerRequest(int originEqId, int destinationEqId) {
+	pthread_mutex_lock(&bucketsLock);
+	bool pending = pendingRequests[originEqId][destinationEqId] > 0;
+	if(pending) {
+		pendingRequests[originEqId][destinationEqId]--;
+	}
+	pthread_mutex_unlock(&bucketsLock);
+	return pending;
+}
+
+/**
+ * Add an equipment to a group, creating the group if it has no members yet
+ * 
+ * @param equipId : the equipment joining the group
+ * @param name : the name of the group (truncated to MAX_GROUP_NAME - 1 characters)
+ */
+void _joinGroup(int equipId, char* name) {
+	char groupName[MAX_GROUP_NAME] = { 0 };
+	strncpy(groupName, name, MAX_GROUP_NAME - 1);
+
+	pthread_mutex_lock(&groupsLock);
+	int index = -1;
+	for(int g = 0; g < MAX_EQUIPMENTS; g++) {
+		if(groups[g].memberCount > 0 && strcmp(groups[g].name, groupName) == 0) {
+			index = g;
+			break;
+		}
+		if(groups[g].memberCount == 0 && index == -1) {
+			index = g;
+		}
+	}
+	if(groups[index].memberCount == 0) {
+		strcpy(groups[index].name, groupName);
+	}
+	groups[index].members[groups[index].memberCount++] = equipId;
+	equipmentGroups[equipId] = index;
+	pthread_mutex_unlock(&groupsLock);
+}
+
+/**
+ * Remove an equipment from its group
+ * 
+ * @param equipId : the equipment leaving its group
+ */
+void _leaveGroup(int equipId) {
+	pthread_mutex_lock(&groupsLock);
+	int index = equipmentGroups[equipId];
+	if(index != -1) {
+		group *g = &groups[index];
+		for(int m = 0; m < g->memberCount; m++) {
+			if(g->members[m] == equipId) {
+				g->members[m] = g->members[--g->memberCount];
+				break;
+			}
+		}
+		equipmentGroups[equipId] = -1;
+	}
+	pthread_mutex_unlock(&groupsLock);
+}
+
+/**
+ * Copy the member list of an equipment's group, so it can be fanned out without holding the lock
+ * 
+ * @param equipId : the equipment whose group is wanted
+ * @param members : array (of MAX_EQUIPMENTS positions) to store the members
+ * @return the number of members (0 if the equipment is in no group)
+ */
+int _groupMembers(int equipId, int *members) {
+	pthread_mutex_lock(&groupsLock);
+	int count = 0;
+	int index = equipmentGroups[equipId];
+	if(index != -1) {
+		count = groups[index].memberCount;
+		memcpy(members, groups[index].members, sizeof(int) * count);
+	}
+	pthread_mutex_unlock(&groupsLock);
+	return count;
+}
+
+/**
+ * Copy the name of an equipment's group
+ * 
+ * @param equipId : the equipment whose group is wanted
+ * @param name : string (of MAX_GROUP_NAME positions) to store the name, empty if the equipment is in no group
+ */
+void _groupName(int equipId, char* name) {
+	pthread_mutex_lock(&groupsLock);
+	int index = equipmentGroups[equipId];
+	strcpy(name, index != -1 ? groups[index].name : "");
+	pthread_mutex_unlock(&groupsLock);
 }
 
 /**
- * Send equipment list to equipId 
+ * Send the list of equipments of its group to equipId 
  * 
  * @param equipId: The equipment that will receive the message
  */
 void _sendEqList(int equipId) {
 	bool first = true;
 	char payload[MAX_BYTES] = { 0 };
-	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+	int members[MAX_EQUIPMENTS];
+	int count = _groupMembers(equipId, members);
+	for(int m = 0; m < count; m++) {
+		int i = members[m];
 		if(equipments[i]) {
 			sprintf(payload, "%s%s%s%d", payload, first ? "" : ",",  i < 10 ? "0" : "", i);
 			first = false;
 		}
 	}
-	_sendMessage(RES_LIST, -1, equipId, payload, DESTINATION_EQ_ID);
+	_sendMessage(RES_LIST, -1, equipId, payload, DESTINATION_EQ_ID);
+}
+
+/**
+ * Send a message to the registered members of a group attached to this node, once per connection: a connection with several members receives it a single time.
+ * The members attached to peer nodes are reached by their own node.
+ *
+ * @param members : the members of the group
+ * @param count : the number of members
+ * @param exceptConnection : a thread/connection that should not receive the message (-1 for none)
+ * @param skipRestored : whether the members restored from the snapshot (which already know the fleet) should be skipped
+ * @param idMsg : the ID of the message type
+ * @param originEqId : the origin equipment id, as on _sendMessage
+ * @param payload : the payload of the message, as on _sendMessage
+ */
+void _sendToMembers(int *members, int count, int exceptConnection, bool skipRestored, char* idMsg, int originEqId, char* payload) {
+	bool notified[MAX_EQUIPMENTS + 1] = { false };
+	for(int m = 0; m < count; m++) {
+		int i = members[m];
+		if(!_isNodeEquipment(i, nodeIndex) || (skipRestored && restoredEquipments[i])) continue;
+		int connection = equipmentConnections[i];
+		if(connection == exceptConnection || notified[connection]) continue;
+		notified[connection] = true;
+		_sendMessage(idMsg, originEqId, i, payload, DESTINATION_EQ_ID);
+	}
+}
+
+/**
+ * Tell a peer node that an equipment attached to this node was added (RES_ADD, with its group) or removed (REQ_REM)
+ *
+ * @param node : the peer node
+ * @param idMsg : RES_ADD or REQ_REM
+ * @param equipId : the equipment attached to this node
+ */
+void _announceToPeer(int node, char* idMsg, int equipId) {
+	int sockId = peerSockets[node];
+	if(sockId == -1) {
+		// the node learns every equipment when its link is opened again
+		return;
+	}
+	char payload[MAX_BYTES] = { 0 };
+	char groupName[MAX_GROUP_NAME];
+	_groupName(equipId, groupName);
+	sprintf(payload, "%s%d %s", equipId < 10 ? "0" : "", equipId, groupName);
+	_sendMessage(idMsg, equipId, -1, payload, sockId);
+}
+
+/**
+ * Tell every peer node that an equipment attached to this node was added or removed
+ *
+ * @param idMsg : RES_ADD or REQ_REM
+ * @param equipId : the equipment attached to this node
+ */
+void _announceToPeers(char* idMsg, int equipId) {
+	for(int node = 0; node < nodeCount; node++) {
+		if(node != nodeIndex) {
+			_announceToPeer(node, idMsg, equipId);
+		}
+	}
+}
+
+/**
+ * Generate a new resume token for an equipment
+ * 
+ * @param equipId : the equipment that will own the token
+ */
+void _generateResumeToken(int equipId) {
+	unsigned long long value = ((unsigned long long) rand() << 32) ^ rand();
+	FILE *random = fopen("/dev/urandom", "rb");
+	if(random != NULL) {
+		fread(&value, sizeof(value), 1, random);
+		fclose(random);
+	}
+	sprintf(resumeTokens[equipId], "%016llx", value);
+}
+
+/**
+ * Send RES_ADD to the equipment that was just (re)registered, along with its resume token
+ * 
+ * @param equipId : the equipment that was registered
+ */
+void _sendOwnId(int equipId) {
+	char payload[MAX_BYTES] = { 0 };
+	sprintf(payload, "%s%d %s", equipId < 10 ? "0" : "", equipId, resumeTokens[equipId]);
+	_sendMessage(RES_ADD, -1, equipId, payload, DESTINATION_EQ_ID);
+}
+
+/**
+ * Add the equipment to its group and broadcast it to the members of the group
+ * 
+ * @param equipId : the equipment that was just added (already taken and bound to its connection)
+ * @param groupName : the group the equipment joins
+ */
+void _handleAddEquipment(int equipId, char* groupName) {
+	_generateResumeToken(equipId);
+	_leaveGroup(equipId);
+	_joinGroup(equipId, groupName);
+
+	// The connection that registered the equipment learns it from the RES_ADD with the resume token
+	_sendOwnId(equipId);
+	int members[MAX_EQUIPMENTS];
+	int count = _groupMembers(equipId, members);
+	char addedEquipId[MAX_BYTES] = { 0 };
+	sprintf(addedEquipId, "%s%d", equipId < 10 ? "0" : "", equipId);
+	_sendToMembers(members, count, equipmentConnections[equipId], false, RES_ADD, -1, addedEquipId);
+	printf("Equipment %s%d added\n", equipId < 10 ? "0" : "", equipId);
+	restoredEquipments[equipId] = false;
+	_resetBuckets(equipId);
+	_announceToPeers(RES_ADD, equipId);
+	_sendEqList(equipId);
+}
+
+/**
+ * Give an equipment its id (and group) from before the server restart back, if the token matches the one saved on the snapshot.
+ * Only the members of its group that joined after the restart are told about it, the rest of the restored fleet already knows it.
+ * 
+ * @param connection : the thread/connection the request came from
+ * @param resumedId : the id the equipment had before the restart
+ * @param token : the resume token the equipment received on its RES_ADD
+ * @return true if the session was resumed, false if the equipment should be added as a new one
+ */
+bool _handleResumeEquipment(int connection, int resumedId, char* token) {
+	// the held id is only given back once, even to two connections presenting its token at the same time
+	pthread_mutex_lock(&registryLock);
+	if(resumedId < EQUIPMENT_RANGE_FROM || resumedId > MAX_EQUIPMENTS || !_isReserved(resumedId) || strcmp(resumeTokens[resumedId], token) != 0) {
+		pthread_mutex_unlock(&registryLock);
+		return false;
+	}
+	_bindEquipment(resumedId, connection);
+	reservedUntil[resumedId] = 0;
+	equipments[resumedId] = true;
+	pthread_mutex_unlock(&registryLock);
+	restoredEquipments[resumedId] = true;
+	_resetBuckets(resumedId);
+
+	int members[MAX_EQUIPMENTS];
+	int count = _groupMembers(resumedId, members);
+	char resumedEquipId[MAX_BYTES] = { 0 };
+	sprintf(resumedEquipId, "%s%d", resumedId < 10 ? "0" : "", resumedId);
+	_sendToMembers(members, count, connection, true, RES_ADD, -1, resumedEquipId);
+	printf("Equipment %s%d resumed\n", resumedId < 10 ? "0" : "", resumedId);
+	_announceToPeers(RES_ADD, resumedId);
+	_sendOwnId(resumedId);
+	_sendEqList(resumedId);
+	return true;
+}
+
+/**
+ * Load the registry saved by a previous run and hold its ids (the ones this node owns) for their equipments to resume them
+ */
+void _loadSnapshot() {
+	FILE *snapshot = fopen(snapshotPath, "r");
+	if(snapshot == NULL) {
+		return;
+	}
+	int equipId;
+	char token[RESUME_TOKEN_SIZE];
+	char groupName[MAX_GROUP_NAME];
+	while(fscanf(snapshot, "%d %16s %31s", &equipId, token, groupName) == 3) {
+		if(equipId < EQUIPMENT_RANGE_FROM || equipId > MAX_EQUIPMENTS || _ownerNode(equipId) != nodeIndex || equipmentGroups[equipId] != -1) continue;
+		strcpy(resumeTokens[equipId], token);
+		_joinGroup(equipId, groupName);
+		reservedUntil[equipId] = time(NULL) + RESUME_GRACE_SECONDS;
+	}
+	fclose(snapshot);
+}
+
+/**
+ * Write the registry (and the ids still held for resuming equipments) to the snapshot file.
+ * It is written to a temporary file and renamed, so a crash never leaves a truncated snapshot.
+ */
+void _saveSnapshot() {
+	char tempPath[MAX_BYTES] = { 0 };
+	sprintf(tempPath, "%s.tmp", snapshotPath);
+	FILE *snapshot = fopen(tempPath, "w");
+	if(snapshot == NULL) {
+		perror("snapshot");
+		return;
+	}
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		char groupName[MAX_GROUP_NAME];
+		_groupName(i, groupName);
+		if((_isNodeEquipment(i, nodeIndex) || _isReserved(i)) && strlen(groupName) > 0) {
+			fprintf(snapshot, "%d %s %s\n", i, resumeTokens[i], groupName);
+		}
+	}
+	fclose(snapshot);
+	rename(tempPath, snapshotPath);
+}
+
+/**
+ * Remove the equipment from its group and broadcast the removal to the other members of the group
+ * 
+ * @param toRemove : the equipment that was just removed
+ * @param exceptConnection : the thread/connection the equipment was registered on, which already knows (-1 for none)
+ */
+void _broadcastEquipmentRemoved(int toRemove, int exceptConnection) {
+	int members[MAX_EQUIPMENTS];
+	int count = _groupMembers(toRemove, members);
+	_leaveGroup(toRemove);
+	_sendToMembers(members, count, exceptConnection, false, REQ_REM, toRemove, "");
+}
+
+/**
+ * Unregister an equipment and broadcast its removal to its group (and to the peer nodes, if it was attached to this one)
+ *
+ * @param equipId : the equipment to remove
+ */
+void _removeEquipment(int equipId) {
+	if(_isNodeEquipment(equipId, nodeIndex)) {
+		_announceToPeers(REQ_REM, equipId);
+	}
+	int connection = equipmentConnections[equipId];
+	equipments[equipId] = false;
+	equipmentConnections[equipId] = -1;
+	resumeTokens[equipId][0] = '\0';
+	printf("Equipment %s%d removed\n", equipId < 10 ? "0" : "", equipId);
+	_broadcastEquipmentRemoved(equipId, connection);
+}
+
+/**
+ * Thread that periodically saves the snapshot and releases the held ids whose equipments did not come back
+ * 
+ * @param arg : unused
+ */
+void *threadSnapshot(void *arg) {
+	while(true) {
+		sleep(SNAPSHOT_INTERVAL_SECONDS);
+		pthread_mutex_lock(&snapshotLock);
+		for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+			// an id is either given back to its equipment or released, never both
+			pthread_mutex_lock(&registryLock);
+			bool expired = reservedUntil[i] != 0 && !_isReserved(i);
+			if(expired) {
+				reservedUntil[i] = 0;
+				resumeTokens[i][0] = '\0';
+			}
+			pthread_mutex_unlock(&registryLock);
+			if(expired) {
+				printf("Equipment %s%d removed\n", i < 10 ? "0" : "", i);
+				_broadcastEquipmentRemoved(i, -1);
+			}
+		}
+		_saveSnapshot();
+		pthread_mutex_unlock(&snapshotLock);
+	}
+	int* returnMessage;
+	return returnMessage;
+}
+
+/**
+ * Handle a equipment removal request, the connection is closed once its last equipment is removed
+ * 
+ * @param toRemove : the equipment that will be removed
+ * @param connection : the thread/connection that requested the removal (must have registered toRemove)
+ */
+void _handleRemoveEquipment(int toRemove, int connection) {
+	if(toRemove < EQUIPMENT_RANGE_FROM || toRemove > MAX_EQUIPMENTS || !equipments[toRemove] || equipmentConnections[toRemove] != connection) {
+		_sendError(connection, toRemove, -1, ERR_EQUIPMENT_NOT_FOUND);
+	}else{
+		_sendMessage(OK, -1, toRemove, SUCCESSFUL_REMOVAL, connectionSockets[connection]);
+		_removeEquipment(toRemove);
+		if(_connectionEquipmentCount(connection) == 0) {
+			busyThreads[connection] = false;
+			_closeAfterFlush(connectionSockets[connection]);
+		}
+	}
+}
+
+/**
+ * Whether a message claiming to come from originEqId may be accepted from a connection
+ * 
+ * @param originEqId : the origin equipment id of the message
+ * @param connection : the thread/connection the message came from
+ */
+bool _isOriginValid(int originEqId, int connection) {
+	return originEqId >= EQUIPMENT_RANGE_FROM && originEqId <= MAX_EQUIPMENTS && equipments[originEqId] && equipmentConnections[originEqId] == connection;
+}
+
+/**
+ * Forward a REQ_INF to every other equipment of the requester's group, each of them subject to the rate limits
+ * 
+ * @param originEqId : the equipment that requested the information
+ * @param connection : the thread/connection the request came from
+ * @return false if any of the members was throttled
+ */
+bool _handleGroupInfo(int originEqId, int connection) {
+	int members[MAX_EQUIPMENTS];
+	int count = _groupMembers(originEqId, members);
+	bool throttled = false;
+	for(int m = 0; m < count; m++) {
+		int i = members[m];
+		if(i == originEqId || !_isReachable(i)) continue;
+		if(!_allowRequest(originEqId, i)) {
+			throttled = true;
+			continue;
+		}
+		_forwardRequest(originEqId, i);
+	}
+	if(throttled) {
+		_sendError(connection, originEqId, GROUP_DESTINATION, ERR_RATE_LIMITED);
+	}
+	return !throttled;
+}
+
+/**
+ * Handle a equipment information request
+ * 
+ * @param originEqId : the equipment that requested the information
+ * @param destinationEqId : the equipment that the information is requested from (GROUP_DESTINATION for every member of the requester's group)
+ * @param connection : the thread/connection the request came from (must have registered originEqId)
+ */
+bool _handleEquipmentInfo(int originEqId, int destinationEqId, int connection) {
+	if(!_isOriginValid(originEqId, connection)) {
+		_sendError(connection, originEqId, destinationEqId, ERR_SOURCE_EQUIPMENT_NOT_FOUND);
+		printf("Equipment %s%d not found\n", originEqId < 10 ? "0" : "", originEqId);
+		return false;
+	}
+
+	if(destinationEqId == GROUP_DESTINATION) {
+		return _handleGroupInfo(originEqId, connection);
+	}
+
+	// an equipment of a node whose link is down cannot be reached until the link is opened again
+	if(destinationEqId < EQUIPMENT_RANGE_FROM || destinationEqId > MAX_EQUIPMENTS || !_isReachable(destinationEqId)) {
+		_sendError(connection, originEqId, destinationEqId, ERR_TARGET_EQUIPMENT_NOT_FOUND);
+		printf("Equipment %s%d not found\n", destinationEqId < 10 ? "0" : "", destinationEqId);
+		return false;
+	}
+
+	if(!_allowRequest(originEqId, destinationEqId)) {
+		_sendError(connection, originEqId, destinationEqId, ERR_RATE_LIMITED);
+		return false;
+	}
+
+	_forwardRequest(originEqId, destinationEqId);
+	return true;
+}
+
+
+/**
+ * Handle a equipment information request response
+ * 
+ * @param originEqId : the equipment that is reponding - the one that the info was requested from
+ * @param destinationEqId : the equipment that requested the information and will receive it
+ * @param payload : the information to be forwared to {destinationEqId}
+ * @param connection : the thread/connection the response came from (must have registered originEqId)
+ */
+bool _handleResEquipmentInfo(int originEqId, int destinationEqId, char* payload, int connection) {
+	if(!_isOriginValid(originEqId, connection)) {
+		_sendError(connection, originEqId, destinationEqId, ERR_SOURCE_EQUIPMENT_NOT_FOUND);
+		printf("Equipment %d not found\n", originEqId);
+		return false;
+	}
+
+	if(destinationEqId < EQUIPMENT_RANGE_FROM || destinationEqId > MAX_EQUIPMENTS || !_isReachable(destinationEqId)) {
+		_sendError(connection, originEqId, destinationEqId, ERR_TARGET_EQUIPMENT_NOT_FOUND);
+		printf("Equipment %d not found\n", destinationEqId);
+		return false;
+	}
+
+	if(!_answerRequest(originEqId, destinationEqId)) {
+		_sendError(connection, originEqId, destinationEqId, ERR_NO_PENDING_REQUEST);
+		return false;
+	}
+
+	_sendMessage(RES_INF, originEqId, destinationEqId, payload, DESTINATION_EQ_ID);
+	return true;
 }
 
 /**
- * Broadcast the added equipment to all the clients
- * 
- * @param equipId : the equipment that was just added
+ * Register an equipment announced by a peer node, its messages are routed through the link to that node
+ *
+ * @param node : the peer node the equipment is attached to (must own the id)
+ * @param equipId : the equipment that was added
+ * @param groupName : the group of the equipment
  */
-void _handleAddEquipment(int equipId) {
-	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
-		if(!busyThreads[i]) continue;
-		char* addedEquipId = malloc(sizeof(char) * 2);
-		sprintf(addedEquipId, "%s%d", equipId < 10 ? "0" : "", equipId);
-		_sendMessage(RES_ADD, -1, i, addedEquipId, DESTINATION_EQ_ID);
-		free(addedEquipId);
+void _handleRemoteAdd(int node, int equipId, char* groupName) {
+	if(equipId < EQUIPMENT_RANGE_FROM || equipId > MAX_EQUIPMENTS || _ownerNode(equipId) != node || equipments[equipId]) {
+		// not the node's id, or already known (the node announces every equipment again when its link is reopened)
+		return;
 	}
+	threadSocketsMap[equipId] = peerSockets[node];
+	_leaveGroup(equipId);
+	_joinGroup(equipId, groupName);
+
+	int members[MAX_EQUIPMENTS];
+	int count = _groupMembers(equipId, members);
+	char addedEquipId[MAX_BYTES] = { 0 };
+	sprintf(addedEquipId, "%s%d", equipId < 10 ? "0" : "", equipId);
+	_sendToMembers(members, count, -1, false, RES_ADD, -1, addedEquipId);
 	printf("Equipment %s%d added\n", equipId < 10 ? "0" : "", equipId);
 	equipments[equipId] = true;
-	_sendEqList(equipId);
+	restoredEquipments[equipId] = false;
+	_resetBuckets(equipId);
 }
 
 /**
- * Broadcast the removed equipment to all the clients
- * 
- * @param toRemove : the equipment that was just removed
+ * Unregister every equipment attached to a peer node whose link dropped
+ *
+ * @param node : the peer node
  */
-void _broadcastEquipmentRemoved(int toRemove) {
+void _removeNodeEquipments(int node) {
 	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
-		if(busyThreads[i]) {
-			_sendMessage(REQ_REM, toRemove, -1, "", threadSocketsMap[i]);
+		if(_isNodeEquipment(i, node)) {
+			_removeEquipment(i);
 		}
 	}
 }
 
 /**
- * Handle a equipment removal request
- * 
- * @param toRemove : the equipment that will be removed
- * @param originEqId : the equipment that requested the removal (should match toRemove)
+ * Start using a new link to a peer node: route the node's equipments through it and announce this node's equipments on it
+ *
+ * @param node : the peer node
+ * @param connection : the thread/connection of the link
+ * @param sockId : the socket of the link
  */
-_handleRemoveEquipment(int toRemove, int originEqId) {
-	if(!equipments[toRemove]) {
-		_sendMessage(ERROR, -1, -1, ERR_EQUIPMENT_NOT_FOUND, threadSocketsMap[originEqId]);
-	}else{
-		equipments[toRemove] = false;
-		busyThreads[toRemove] = false;
-		_sendMessage(OK, -1, originEqId, SUCCESSFUL_REMOVAL, threadSocketsMap[originEqId]);
-		close(threadSocketsMap[originEqId]);
-		printf("Equipment %s%d removed\n", toRemove < 10 ? "0" : "", toRemove);
+void _openPeerLink(int node, int connection, int sockId) {
+	connectionNodes[connection] = node;
+	nodeConnections[node] = connection;
+	peerSockets[node] = sockId;
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(_ownerNode(i) == node) {
+			threadSocketsMap[i] = sockId;
+		}
+	}
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(_isNodeEquipment(i, nodeIndex)) {
+			_announceToPeer(node, RES_ADD, i);
+		}
+	}
+	printf("Linked to node %d\n", node);
+}
 
-		_broadcastEquipmentRemoved(toRemove);
+/**
+ * Stop routing through the link of a peer node that dropped (or was replaced) and unregister the equipments attached to that node.
+ * The socket is closed by the thread/connection of the link.
+ *
+ * @param node : the peer node
+ */
+void _closePeerLink(int node) {
+	nodeConnections[node] = -1;
+	peerSockets[node] = -1;
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(_ownerNode(i) == node) {
+			threadSocketsMap[i] = -1;
+		}
 	}
+	printf("Link to node %d lost\n", node);
+	_removeNodeEquipments(node);
 }
 
 /**
- * Handle a equipment information request
- * 
- * @param originEqId : the equipment that requested the information
- * @param destinationEqId : the equipment that the information is requested from
- * @param realEqId : the equipment id that the server identified as the requester (should match originEqId - a validation would be needed for security purposes)
+ * Deliver a REQ_INF or RES_INF relayed by a peer node to the equipment of this node it is addressed to.
+ * The origin node already validated it. A REQ_INF is also rate limited here, where every request to the target is seen whatever node it came from.
+ *
+ * @param node : the peer node that relayed the message (the origin must be attached to it)
+ * @param idMsg : REQ_INF or RES_INF
+ * @param originEqId : the equipment that sent the message
+ * @param destinationEqId : the equipment of this node that will receive it
+ * @param payload : the payload of the message (empty for a REQ_INF)
  */
-bool _handleEquipmentInfo(int originEqId, int destinationEqId, int realEqId) {
-	if(originEqId > MAX_EQUIPMENTS || !equipments[originEqId]) {
-		_sendMessage(ERROR, originEqId, destinationEqId, ERR_SOURCE_EQUIPMENT_NOT_FOUND, threadSocketsMap[realEqId]);
+bool _handlePeerData(int node, char* idMsg, int originEqId, int destinationEqId, char* payload) {
+	if(!_isNodeEquipment(originEqId, node)) {
 		printf("Equipment %s%d not found\n", originEqId < 10 ? "0" : "", originEqId);
 		return false;
 	}
 
-	if(destinationEqId > MAX_EQUIPMENTS || !equipments[destinationEqId]) {
-		_sendMessage(ERROR, originEqId, destinationEqId, ERR_TARGET_EQUIPMENT_NOT_FOUND, threadSocketsMap[realEqId]);
+	if(!_isNodeEquipment(destinationEqId, nodeIndex)) {
 		printf("Equipment %s%d not found\n", destinationEqId < 10 ? "0" : "", destinationEqId);
 		return false;
 	}
 
-	_sendMessage(REQ_INF, originEqId, destinationEqId, "", DESTINATION_EQ_ID);
+	if(strcmp(idMsg, REQ_INF) == 0) {
+		if(!_allowRequest(originEqId, destinationEqId)) {
+			// the requester is told through the node it is attached to, as it would be by its own node
+			if(peerSockets[node] != -1) {
+				_sendMessage(ERROR, originEqId, destinationEqId, ERR_RATE_LIMITED, peerSockets[node]);
+			}
+			return false;
+		}
+		_forwardRequest(originEqId, destinationEqId);
+	} else {
+		_sendMessage(RES_INF, originEqId, destinationEqId, payload, DESTINATION_EQ_ID);
+	}
 	return true;
 }
 
-
 /**
- * Handle a equipment information request response
- * 
- * @param originEqId : the equipment that is reponding - the one that the info was requested from
- * @param destinationEqId : the equipment that requested the information and will receive it
- * @param payload : the information to be forwared to {destinationEqId}
- * @param realEqId : the equipment id that the server identified as the sender of this message (should match originEqId - a validation would be needed for security purposes) 
+ * Handle a message received on the link of a peer node: changes to its registry and data messages for the equipments of this node
+ *
+ * @param node : the peer node that sent the message
+ * @param command : the ID of the message type
+ * @param subtokens : the fields of the message
+ * @param subtSize : the number of fields
  */
-bool _handleResEquipmentInfo(int originEqId, int destinationEqId, char* payload, int realEqId) {
-	if(originEqId > MAX_EQUIPMENTS || !equipments[originEqId]) {
-		_sendMessage(ERROR, originEqId, destinationEqId, ERR_SOURCE_EQUIPMENT_NOT_FOUND, threadSocketsMap[realEqId]);
-		printf("Equipment %d not found\n", originEqId);
-		return false;
+void _handlePeerMessage(int node, char* command, char** subtokens, int subtSize) {
+	if(strcmp(command, RES_ADD) == 0 && subtSize >= 2) {
+		_handleRemoteAdd(node, atoi(subtokens[0]), subtokens[1]);
+	} else if(strcmp(command, REQ_REM) == 0 && subtSize >= 1) {
+		int toRemove = atoi(subtokens[0]);
+		if(_isNodeEquipment(toRemove, node)) {
+			_removeEquipment(toRemove);
+		}
+	} else if(strcmp(command, REQ_INF) == 0 && subtSize >= 2) {
+		_handlePeerData(node, REQ_INF, atoi(subtokens[0]), atoi(subtokens[1]), "");
+	} else if(strcmp(command, RES_INF) == 0 && subtSize >= 3) {
+		_handlePeerData(node, RES_INF, atoi(subtokens[0]), atoi(subtokens[1]), subtokens[2]);
+	} else if(strcmp(command, ERROR) == 0 && subtSize >= 3) {
+		// an error for a request of an equipment of this node, e.g. it was throttled by the target's node
+		int originEqId = atoi(subtokens[0]);
+		if(_isNodeEquipment(originEqId, nodeIndex)) {
+			_sendError(equipmentConnections[originEqId], originEqId, atoi(subtokens[1]), subtokens[2]);
+		}
 	}
+}
 
-	if(destinationEqId > MAX_EQUIPMENTS || !equipments[destinationEqId]) {
-		_sendMessage(ERROR, originEqId, destinationEqId, ERR_TARGET_EQUIPMENT_NOT_FOUND, threadSocketsMap[realEqId]);
-		printf("Equipment %d not found\n", destinationEqId);
-		return false;
+/**
+ * Check the secret presented on a PEER_HELLO against the federation's, taking as long whatever the secret is so a client cannot guess it byte by byte
+ *
+ * @param secret : the secret presented
+ * @return true if it is the federation's secret
+ */
+bool _isNodeSecret(char *secret) {
+	size_t length = strlen(nodeSecret);
+	size_t presented = strlen(secret);
+	unsigned char difference = presented != length;
+	for(size_t i = 0; i < length; i++) {
+		difference |= nodeSecret[i] ^ (i < presented ? secret[i] : 0);
 	}
+	return difference == 0;
+}
 
-	_sendMessage(RES_INF, originEqId, destinationEqId, payload, DESTINATION_EQ_ID);
-	return true;
+/**
+ * Turn a connection into the link of a peer node, if that node opens the links to this one (it has a higher index) and it presented the federation's secret.
+ * A node that links again (e.g. after it restarted) replaces its previous link, whose equipments are removed: the node announces its current ones on the new link.
+ *
+ * @param connection : the thread/connection that sent the PEER_HELLO
+ * @param node : the peer node it claims to come from
+ * @param secret : the secret it presented
+ */
+void _handlePeerHello(int connection, int node, char *secret) {
+	if(node <= nodeIndex || node >= nodeCount || _connectionEquipmentCount(connection) != 0 || !_isNodeSecret(secret)) {
+		printf("Refused a link claiming to come from node %d\n", node);
+		return;
+	}
+	int previous = nodeConnections[node];
+	if(previous != -1) {
+		_closePeerLink(node);
+		shutdown(connectionSockets[previous], SHUT_RDWR);
+	}
+	_openPeerLink(node, connection, connectionSockets[connection]);
 }
 
 
 /**
  * Parse the message and delegate the action to the correct function
  * 
- * @param equipId : the equipment that sent the message
+ * @param connection : the thread/connection that sent the message
  * @param message : all the content of the message
  */
-void _handleMessage(int equipId, char *message) {
-	char **tokens = malloc(sizeof(char *) * MAX_TOKENS);
+void _handleMessage(int connection, char *message) {
+	// a line has fewer tokens than bytes, however many a misbehaving client puts on it
+	char **tokens = malloc(sizeof(char *) * (strlen(message) + 1));
 	int tc; split(message, tokens, &tc, " ");
 
 	char* command = tokens[0];
@@ -220,21 +1551,60 @@ void _handleMessage(int equipId, char *message) {
 		subtokens[i - 1] = tokens[i];
 	}
 
-	// if command is an equipment registering
-	if(strcmp(command, REQ_ADD) == 0) { 
-		_handleAddEquipment(equipId);
+	if(connectionNodes[connection] != -1) {
+		// a link replaced by a newer one of the same node is ignored until it is closed
+		if(nodeConnections[connectionNodes[connection]] == connection) {
+			_handlePeerMessage(connectionNodes[connection], command, subtokens, subtSize);
+		}
+	} else if(strcmp(command, PEER_HELLO) == 0 && subtSize >= 1) {
+		// 09 <node index> <secret>, the connection is a peer node's link from now on
+		_handlePeerHello(connection, atoi(subtokens[0]), subtSize >= 2 ? subtokens[1] : "");
+	} else if(strcmp(command, REQ_ADD) == 0) {
+		// if command is an equipment registering
+		// 01 [<group> [<previous id> <resume token>]]
+		char* groupName = subtSize >= 1 ? subtokens[0] : DEFAULT_GROUP;
+		if(subtSize >= 3 && _handleResumeEquipment(connection, atoi(subtokens[1]), subtokens[2])) {
+			// session resumed, no membership broadcast needed
+		} else {
+			// a connection may register several equipments, each REQ_ADD takes a new id
+			int equipId = _takeEquipmentId(connection);
+			if(equipId == -1) {
+				_sendError(connection, -1, -1, ERR_EQUIPMENT_LIMIT_EXCEEDED);
+				if(_connectionEquipmentCount(connection) == 0) {
+					busyThreads[connection] = false;
+					_closeAfterFlush(connectionSockets[connection]);
+				}
+			} else {
+				_handleAddEquipment(equipId, groupName);
+			}
+		}
+	} else if((strcmp(command, REQ_REM) == 0 && subtSize < 1) || (strcmp(command, REQ_INF) == 0 && subtSize < 2) || (strcmp(command, RES_INF) == 0 && subtSize < 3)) {
+		// a message missing some of its fields is refused, whatever the equipment meant
+		_sendError(connection, -1, -1, ERR_INVALID_MESSAGE);
 	} else if(strcmp(command, REQ_REM) == 0) { 
-		_handleRemoveEquipment(atoi(subtokens[0]), equipId);
+		_handleRemoveEquipment(atoi(subtokens[0]), connection);
 	} else if(strcmp(command, REQ_INF) == 0) { 
-		_handleEquipmentInfo(atoi(subtokens[0]), atoi(subtokens[1]), equipId);
+		_handleEquipmentInfo(atoi(subtokens[0]), atoi(subtokens[1]), connection);
 	} else if(strcmp(command, RES_INF) == 0) { 
-		_handleResEquipmentInfo(atoi(subtokens[0]), atoi(subtokens[1]), subtokens[2], equipId);
+		_handleResEquipmentInfo(atoi(subtokens[0]), atoi(subtokens[1]), subtokens[2], connection);
 	}
 
+	free(tokens);
 	free(subtokens);
 }
 
 
+/**
+ * Cleanup handler of a connection thread cancelled for a handoff, keeps the bytes of its incomplete message
+ * 
+ * @param arg {connectionBuffer*} : the local state of the thread
+ */
+void _savePendingBuffer(void *arg) {
+	connectionBuffer *c = (connectionBuffer *) arg;
+	memcpy(pendingBuffers[c->connection], c->buffer, *c->pending);
+	pendingLengths[c->connection] = *c->pending;
+}
+
 /**
  * Thread function that repeateadly expects message from a client
  * 
@@ -242,43 +1612,135 @@ void _handleMessage(int equipId, char *message) {
  */
 void *threadConnection(void *arg) {
 	threadArgs tArgs = *((threadArgs *) arg);
-	busyThreads[tArgs.threadId] = true;
-	threadSocketsMap[tArgs.threadId] = tArgs.sockId;
+	free(arg);
+
+	// The thread may only be cancelled (for a handoff) while it waits for a message
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	int connection = tArgs.threadId;
+
+	// Bytes of a message that was not fully received yet are kept at the start of the buffer (and may come from the previous server)
+	char buffer[MAX_BYTES * 2 + 1] = { 0 };
+	size_t pending = pendingLengths[connection];
+	memcpy(buffer, pendingBuffers[connection], pending);
+	pendingLengths[connection] = 0;
+
+	connectionBuffer state = { connection, buffer, &pending };
+	pthread_cleanup_push(_savePendingBuffer, &state);
 
-	while(busyThreads[tArgs.threadId]) {
+	while(busyThreads[connection]) {
 		// Receive and print message from client
-		char buffer[MAX_BYTES] = { 0 };
-		int valread = read(tArgs.sockId, buffer, MAX_BYTES);
-
-		if(valread == 0) {
-			printf("Equipment %s%d removed\n", tArgs.threadId < 10 ? "0" : "", tArgs.threadId);
-			busyThreads[tArgs.threadId] = false;
-			equipments[tArgs.threadId] = false;
-			close(tArgs.sockId);
-			_broadcastEquipmentRemoved(tArgs.threadId);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int valread = read(tArgs.sockId, buffer + pending, MAX_BYTES);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if(valread <= 0) {
+			// every equipment registered on the connection is gone
+			for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+				if(equipments[i] && equipmentConnections[i] == connection) {
+					_removeEquipment(i);
+				}
+			}
+			// or, for the current link of a peer node, every equipment attached to that node
+			int node = connectionNodes[connection];
+			if(node != -1 && nodeConnections[node] == connection) {
+				_closePeerLink(node);
+			}
+			connectionNodes[connection] = -1;
+			busyThreads[connection] = false;
+			_closeAfterFlush(tArgs.sockId);
 			break;
 		}
+		pending += valread;
+		buffer[pending] = '\0';
 		
 		if(debug) {
 			printf("(debug) buffer: %s\n", buffer);
 		}
 
-		_handleMessage(tArgs.threadId, buffer);
+		// A single read may hold several messages (or the beginning of one), handle every complete line
+		char *line = buffer;
+		char *end;
+		while(busyThreads[connection] && (end = strchr(line, '\n')) != NULL) {
+			*end = '\0';
+			if(*line != '\0') {
+				_handleMessage(connection, line);
+			}
+			line = end + 1;
+		}
+
+		pending = buffer + pending - line;
+		if(pending >= MAX_BYTES) {
+			// a line longer than any valid message, discard it
+			pending = 0;
+		}
+		memmove(buffer, line, pending);
 	}
+	pthread_cleanup_pop(0);
 	int* returnMessage;
 	return returnMessage;
 }
 
+/**
+ * Start the thread of a connection on the given slot
+ * 
+ * @param slot : the thread/connection position
+ * @param sockId : the socket of the connection
+ */
+void _startConnection(int slot, int sockId) {
+	// The slot is taken before the thread starts, so connections accepted back to back (e.g. equipments resuming after a restart) never share it
+	busyThreads[slot] = true;
+	connectionSockets[slot] = sockId;
+	pthread_mutex_lock(&bucketsLock);
+	_fillBucket(&errorBuckets[slot]);
+	pthread_mutex_unlock(&bucketsLock);
+	threadArgs *tArgs = malloc(sizeof(threadArgs));
+	tArgs->sockId = sockId;
+	tArgs->threadId = slot;
+	pthread_create(&(threads[slot]), NULL, threadConnection, tArgs);
+}
+
+/**
+ * Thread that waits for socket connections from the clients
+ * 
+ * @param arg : unused
+ */
+void *threadAccept(void *arg) {
+	// The thread may only be cancelled (for a handoff) while it waits for a connection
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-int main(int argc, char const* argv[]) {
-	Parameters *p = malloc(sizeof(Parameters));
-	if(!initProgram(p, false, argc, argv)) {
-		return 1;
+	int new_socket;
+	while(true){
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		new_socket = accept(serverSocket, NULL, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (new_socket < 0) {
+			perror("accept");
+			exit(EXIT_FAILURE);
+		}
+		// Create a new thread of the client
+		pthread_mutex_lock(&slotsLock);
+		int newThreadId = threadId();
+		if(newThreadId != -1) {
+			_startConnection(newThreadId, new_socket);
+		}
+		pthread_mutex_unlock(&slotsLock);
+		if(newThreadId == -1) {
+			_sendMessage(ERROR, -1, -1, ERR_EQUIPMENT_LIMIT_EXCEEDED, new_socket);
+			_closeAfterFlush(new_socket);
+		}
 	}
-	_initEquipments();
-	int protocol = AF_INET;
+	int* returnMessage;
+	return returnMessage;
+}
 
-	int server_fd, new_socket;
+/**
+ * Create, bind and listen on the server socket
+ * 
+ * @param port : the port to listen on
+ */
+void _listen(int port) {
+	int protocol = AF_INET;
 
 	int opt = 1;
 	size_t addrlen;
@@ -288,57 +1750,493 @@ int main(int argc, char const* argv[]) {
 	struct sockaddr_in *address4 = (struct sockaddr_in *) &addDestStorage;
 	address4->sin_family = AF_INET;
 	address4->sin_addr.s_addr = INADDR_ANY;
-	address4->sin_port = htons(p->port);
+	address4->sin_port = htons(port);
 	addrlen = sizeof(*address4);
 
 	// Initialize the client Address with the correct configurations for the selected protocol
  	struct sockaddr *destAddress = (struct sockaddr *) &addDestStorage;
 	
 	// Creates socket file descriptor
-	if ((server_fd = socket(protocol, SOCK_STREAM, IPPROTO_TCP)) == 0) {
+	if ((serverSocket = socket(protocol, SOCK_STREAM, IPPROTO_TCP)) == 0) {
 		perror("socket failed");
 		exit(EXIT_FAILURE);
 	}
 
 	// Helps manipulating options for the socket
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+	if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
 		perror("setsockopt");
 		exit(EXIT_FAILURE);
 	}
-	
+
 
 	// Attaches socket to address and port
-	if (bind(server_fd, destAddress, addrlen) < 0) {
+	if (bind(serverSocket, destAddress, addrlen) < 0) {
 		perror("bind failed");
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(server_fd, 3) < 0) {
+	if (listen(serverSocket, 3) < 0) {
 		perror("listen");
 		exit(EXIT_FAILURE);
 	}
+}
 
-	// Wait for socket connections from the client
-	while(true){
-		if ((new_socket = accept(server_fd, destAddress, (socklen_t*) &addrlen)) < 0) {
-			perror("accept");
-			exit(EXIT_FAILURE);
+/**
+ * Parse the federation arguments: this node's index and the federation's secret followed by the address of every node (including this one)
+ *
+ * @param count : the number of arguments
+ * @param arguments : the arguments, as <index> <secret> <IP>:<port>...
+ * @return true if the federation is valid, false otherwise
+ */
+bool _parseNodes(int count, const char *arguments[]) {
+	// the secret travels as one field of the PEER_HELLO
+	if(count < 3 || count - 2 > MAX_NODES || strlen(arguments[1]) == 0 || strlen(arguments[1]) >= MAX_BYTES / 2 || strchr(arguments[1], ' ') != NULL) {
+		return false;
+	}
+	nodeIndex = atoi(arguments[0]);
+	strcpy(nodeSecret, arguments[1]);
+	nodeCount = count - 2;
+	for(int node = 0; node < nodeCount; node++) {
+		char ip[MAX_BYTES] = { 0 };
+		int port;
+		memset(&nodeAddresses[node], 0, sizeof(nodeAddresses[node]));
+		nodeAddresses[node].sin_family = AF_INET;
+		if(sscanf(arguments[node + 2], "%[^:]:%d", ip, &port) != 2 || inet_pton(AF_INET, ip, &nodeAddresses[node].sin_addr) <= 0) {
+			return false;
 		}
-		// Create a new thread of the client
-		int newThreadId = threadId();
-		if(newThreadId == -1) {
-			_sendMessage(ERROR, -1, -1, ERR_EQUIPMENT_LIMIT_EXCEEDED, new_socket);
-			close(new_socket);
-			continue;
+		nodeAddresses[node].sin_port = htons(port);
+	}
+	return nodeIndex >= 0 && nodeIndex < nodeCount;
+}
+
+/**
+ * Connect to a peer node, giving up after PEER_CONNECT_TIMEOUT_SECONDS: a node whose packets are dropped would otherwise hold the thread for minutes
+ *
+ * @param node : the peer node
+ * @return the socket of the link, or -1 if the node is not reachable
+ */
+int _connectToPeer(int node) {
+	int sockId = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sockId < 0) {
+		return -1;
+	}
+	int flags = fcntl(sockId, F_GETFL, 0);
+	fcntl(sockId, F_SETFL, flags | O_NONBLOCK);
+	int connected = connect(sockId, (struct sockaddr *) &nodeAddresses[node], sizeof(nodeAddresses[node]));
+	if(connected < 0 && errno == EINPROGRESS) {
+		struct pollfd pending = { sockId, POLLOUT, 0 };
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if(poll(&pending, 1, PEER_CONNECT_TIMEOUT_SECONDS * 1000) == 1 && getsockopt(sockId, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+			connected = 0;
 		}
-		threadArgs tArgs;
-		tArgs.sockId = new_socket;
-		tArgs.threadId = newThreadId;
-		pthread_create(&(threads[newThreadId]), NULL, threadConnection, &tArgs);
 	}
-	
+	// the link is then read and written as any other connection
+	fcntl(sockId, F_SETFL, flags);
+	if(connected < 0) {
+		close(sockId);
+		return -1;
+	}
+	return sockId;
+}
+
+/**
+ * Open the link to a peer node with a lower index: introduce this node, then read the link as any other connection
+ *
+ * @param node : the peer node
+ */
+void _connectPeerLink(int node) {
+	int sockId = _connectToPeer(node);
+	if(sockId == -1) {
+		return;
+	}
+	pthread_mutex_lock(&slotsLock);
+	int connection = threadId();
+	if(connection != -1) {
+		// everything is queued before the link is read, the node answers the hello with its own equipments
+		char hello[MAX_BYTES] = { 0 };
+		sprintf(hello, "%d %s", nodeIndex, nodeSecret);
+		_sendMessage(PEER_HELLO, -1, -1, hello, sockId);
+		_openPeerLink(node, connection, sockId);
+		_startConnection(connection, sockId);
+	}
+	pthread_mutex_unlock(&slotsLock);
+	if(connection == -1) {
+		close(sockId);
+	}
+}
+
+/**
+ * Thread that keeps the link to a peer node with a lower index open, reopening it whenever it drops
+ *
+ * @param arg {int*} : the peer node
+ */
+void *threadPeerLink(void *arg) {
+	int node = *((int *) arg);
+	free(arg);
+
+	// The thread may only be cancelled (for a handoff) while it waits
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while(true) {
+		// A link received from the previous server is already open
+		if(peerSockets[node] == -1) {
+			_connectPeerLink(node);
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		sleep(PEER_RETRY_SECONDS);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	}
+	int* returnMessage;
+	return returnMessage;
+}
+
+/// Start the threads keeping the links to the peer nodes this one links to (the ones with a lower index link to it)
+void _startPeerLinks() {
+	for(int node = 0; node < nodeIndex; node++) {
+		int *arg = malloc(sizeof(int));
+		*arg = node;
+		pthread_create(&peerThreads[node], NULL, threadPeerLink, arg);
+	}
+}
+
+/**
+ * Fill the unix socket address used for handoffs
+ * 
+ * @param address : the address to fill
+ * @param port : the port the server listens on
+ */
+void _handoffAddress(struct sockaddr_un *address, int port) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	sprintf(address->sun_path, HANDOFF_SOCKET_PATH, port);
+}
+
+/**
+ * Send the registry, the incomplete messages and every socket (listening one first, then the connections' by position, links to the peer nodes included) to the new server
+ * 
+ * @param handoffSocket : the connection to the new server
+ * @return true if the new server acknowledged it took everything over and was told to serve, false if this server should carry on
+ */
+bool _sendHandoff(int handoffSocket) {
+	size_t size = sizeof(handoffHeader) + sizeof(handoffState);
+	char *message = calloc(1, size);
+	handoffHeader *header = (handoffHeader *) message;
+	header->version = HANDOFF_VERSION;
+	header->length = sizeof(handoffState);
+
+	handoffState *state = (handoffState *) (message + sizeof(handoffHeader));
+	memcpy(state->equipments, equipments, sizeof(equipments));
+	memcpy(state->busyThreads, busyThreads, sizeof(busyThreads));
+	memcpy(state->equipmentConnections, equipmentConnections, sizeof(equipmentConnections));
+	memcpy(state->restoredEquipments, restoredEquipments, sizeof(restoredEquipments));
+	memcpy(state->reservedUntil, reservedUntil, sizeof(reservedUntil));
+	memcpy(state->resumeTokens, resumeTokens, sizeof(resumeTokens));
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		_groupName(i, state->groupNames[i]);
+	}
+	memcpy(state->pendingLengths, pendingLengths, sizeof(pendingLengths));
+	memcpy(state->pendingBuffers, pendingBuffers, sizeof(pendingBuffers));
+	memcpy(state->connectionNodes, connectionNodes, sizeof(connectionNodes));
+	memcpy(state->nodeConnections, nodeConnections, sizeof(nodeConnections));
+	memcpy(state->pendingRequests, pendingRequests, sizeof(pendingRequests));
+
+	int fds[MAX_EQUIPMENTS + 1];
+	int fdCount = 0;
+	fds[fdCount++] = serverSocket;
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(busyThreads[i]) {
+			fds[fdCount++] = connectionSockets[i];
+		}
+	}
+
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { message, size };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+
+	// The sockets go with the first bytes, the rest of the registry may need more writes
+	ssize_t sent = sendmsg(handoffSocket, &msg, MSG_NOSIGNAL);
+	while(sent > 0 && sent < size) {
+		ssize_t written = send(handoffSocket, message + sent, size - sent, MSG_NOSIGNAL);
+		sent = written <= 0 ? -1 : sent + written;
+	}
+	free(message);
+	if(sent < 0) {
+		perror("handoff");
+		return false;
+	}
+
+	struct timeval timeout = { HANDOFF_TIMEOUT_SECONDS, 0 };
+	setsockopt(handoffSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char ack = 0;
+	if(read(handoffSocket, &ack, 1) != 1 || ack != HANDOFF_ACK) {
+		return false;
+	}
+	// An acknowledgement arriving after the timeout is never confirmed, the new server then exits instead of serving alongside this one
+	char confirm = HANDOFF_CONFIRM;
+	return write(handoffSocket, &confirm, 1) == 1;
+}
+
+/**
+ * Read from the handoff connection until a given number of bytes of the message was received
+ * 
+ * @param handoffSocket : the connection to the running server
+ * @param message : the message being received
+ * @param received : the bytes of the message received so far, updated as more are read
+ * @param length : the number of bytes wanted
+ * @return true if they were received, false if the connection ended first
+ */
+bool _readHandoff(int handoffSocket, char *message, ssize_t *received, size_t length) {
+	while(*received < length) {
+		ssize_t valread = read(handoffSocket, message + *received, length - *received);
+		if(valread <= 0) {
+			return false;
+		}
+		*received += valread;
+	}
+	return true;
+}
+
+/**
+ * Connect to the running server and take over its listening socket, its clients and its registry.
+ * A registry of another version is refused, the running server then carries on serving.
+ * 
+ * @param port : the port both servers listen on
+ * @return true if the handoff was received, false otherwise
+ */
+bool _receiveHandoff(int port) {
+	struct sockaddr_un address;
+	_handoffAddress(&address, port);
+	int handoffSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(handoffSocket < 0 || connect(handoffSocket, (struct sockaddr *) &address, sizeof(address)) < 0) {
+		perror("handoff connect");
+		return false;
+	}
+
+	size_t size = sizeof(handoffHeader) + sizeof(handoffState);
+	char *message = malloc(size);
+	int fds[MAX_EQUIPMENTS + 1];
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov = { message, size };
+	struct msghdr msg = { 0 };
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t received = recvmsg(handoffSocket, &msg, 0);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	int fdCount = 0;
+	if(received > 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+		fdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fdCount);
+	}
+
+	handoffHeader *header = (handoffHeader *) message;
+	bool valid = fdCount > 0 && _readHandoff(handoffSocket, message, &received, sizeof(handoffHeader));
+	if(valid && (header->version != HANDOFF_VERSION || header->length != sizeof(handoffState))) {
+		printf("Handoff refused: the running server sends version %d (%zu bytes), this one reads version %d (%zu bytes)\n", header->version, header->length, HANDOFF_VERSION, sizeof(handoffState));
+		valid = false;
+	}
+	valid = valid && _readHandoff(handoffSocket, message, &received, size);
+
+	// The running server only lets go of the sockets once it knows they were taken over, and this one only serves once the running server confirmed it stopped
+	// (it decides within HANDOFF_TIMEOUT_SECONDS of sending everything, the confirmation is waited for twice as long)
+	char ack = HANDOFF_ACK;
+	char confirm = 0;
+	struct timeval timeout = { 2 * HANDOFF_TIMEOUT_SECONDS, 0 };
+	setsockopt(handoffSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if(!valid || write(handoffSocket, &ack, 1) != 1 || read(handoffSocket, &confirm, 1) != 1 || confirm != HANDOFF_CONFIRM) {
+		printf("Handoff failed\n");
+		for(int i = 0; i < fdCount; i++) {
+			close(fds[i]);
+		}
+		free(message);
+		close(handoffSocket);
+		return false;
+	}
+	close(handoffSocket);
+
+	handoffState *state = (handoffState *) (message + sizeof(handoffHeader));
+	memcpy(equipments, state->equipments, sizeof(equipments));
+	memcpy(restoredEquipments, state->restoredEquipments, sizeof(restoredEquipments));
+	memcpy(reservedUntil, state->reservedUntil, sizeof(reservedUntil));
+	memcpy(resumeTokens, state->resumeTokens, sizeof(resumeTokens));
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(strlen(state->groupNames[i]) > 0) {
+			_joinGroup(i, state->groupNames[i]);
+		}
+	}
+	memcpy(pendingLengths, state->pendingLengths, sizeof(pendingLengths));
+	memcpy(pendingBuffers, state->pendingBuffers, sizeof(pendingBuffers));
+	memcpy(connectionNodes, state->connectionNodes, sizeof(connectionNodes));
+	memcpy(pendingRequests, state->pendingRequests, sizeof(pendingRequests));
+
+	serverSocket = fds[0];
+	int k = 1;
+	for(int i = 1; i < MAX_EQUIPMENTS + 1 && k < fdCount; i++) {
+		if(state->busyThreads[i]) {
+			busyThreads[i] = true;
+			connectionSockets[i] = fds[k++];
+		}
+	}
+	memcpy(nodeConnections, state->nodeConnections, sizeof(nodeConnections));
+	for(int node = 0; node < MAX_NODES; node++) {
+		if(nodeConnections[node] != -1) {
+			peerSockets[node] = connectionSockets[nodeConnections[node]];
+		}
+	}
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		int connection = state->equipmentConnections[i];
+		if(equipments[i] && connection != -1 && busyThreads[connection]) {
+			_bindEquipment(i, connection);
+		} else if(equipments[i] && _ownerNode(i) != nodeIndex) {
+			threadSocketsMap[i] = peerSockets[_ownerNode(i)];
+		}
+	}
+	free(message);
+	return true;
+}
+
+/// Start accepting and reading the connections (and keeping the links to the peer nodes)
+void _startServing() {
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(busyThreads[i]) {
+			_startConnection(i, connectionSockets[i]);
+		}
+	}
+	_startPeerLinks();
+	pthread_create(&acceptThread, NULL, threadAccept, NULL);
+}
+
+/**
+ * Stop accepting and reading, then flush the queued messages so nothing is lost nor sent twice by the new server.
+ * The clients that do not take their bytes in time are disconnected, the new server could not write them.
+ */
+void _stopServing() {
+	// no connection can be started once the threads starting them are stopped
+	pthread_cancel(acceptThread);
+	pthread_join(acceptThread, NULL);
+	for(int node = 0; node < nodeIndex; node++) {
+		pthread_cancel(peerThreads[node]);
+		pthread_join(peerThreads[node], NULL);
+	}
+	for(int i = 1; i < MAX_EQUIPMENTS + 1; i++) {
+		if(busyThreads[i]) {
+			pthread_cancel(threads[i]);
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	time_t deadline = time(NULL) + HANDOFF_FLUSH_SECONDS;
+	pthread_mutex_lock(&schedulerLock);
+	while(queuedFrames > 0 || outputBytes > 0) {
+		if(time(NULL) >= deadline && !dropOutputs) {
+			dropOutputs = true;
+			write(wakePipe[1], "", 1);
+		}
+		pthread_mutex_unlock(&schedulerLock);
+		usleep(1000);
+		pthread_mutex_lock(&schedulerLock);
+	}
+	dropOutputs = false;
+	pthread_mutex_unlock(&schedulerLock);
+}
+
+/**
+ * Wait for a new server binary to connect and hand everything over to it.
+ * If the handoff does not go through (e.g. the new binary reads another version of the registry), this server resumes serving and waits for the next one.
+ * 
+ * @param port : the port the server listens on
+ */
+void _waitForHandoff(int port) {
+	struct sockaddr_un address;
+	_handoffAddress(&address, port);
+	int handoffListener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(address.sun_path);
+	if(handoffListener < 0 || bind(handoffListener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(handoffListener, 1) < 0) {
+		perror("handoff listen");
+		pthread_join(acceptThread, NULL);
+		return;
+	}
+
+	while(true) {
+		int handoffSocket = accept(handoffListener, NULL, NULL);
+		if(handoffSocket < 0) {
+			perror("handoff accept");
+			close(handoffListener);
+			pthread_join(acceptThread, NULL);
+			return;
+		}
+		printf("Handing off to the new server\n");
+
+		// no held id is released (nor the snapshot saved) between the flush and the copy of the registry, its removal would never be sent
+		pthread_mutex_lock(&snapshotLock);
+		_stopServing();
+		bool handedOff = _sendHandoff(handoffSocket);
+		close(handoffSocket);
+		if(handedOff) {
+			break;
+		}
+		printf("Handoff failed, resuming\n");
+		_startServing();
+		pthread_mutex_unlock(&snapshotLock);
+	}
+	close(handoffListener);
+}
+
+
+int main(int argc, char const* argv[]) {
+	Parameters *p = malloc(sizeof(Parameters));
+	if(!initProgram(p, false, argc, argv)) {
+		return 1;
+	}
+	srand(time(NULL));
+	_initEquipments();
+
+	bool takeover = argc > 2 && strcmp(argv[2], TAKEOVER_ARGUMENT) == 0;
+	int nodeArgument = takeover ? 3 : 2;
+	if(argc > nodeArgument && (strcmp(argv[nodeArgument], NODE_ARGUMENT) != 0 || !_parseNodes(argc - nodeArgument - 1, argv + nodeArgument + 1))) {
+		printf("Usage: %s <port> [takeover] [node <index> <secret> <IP>:<port>...]\n", argv[0]);
+		return 1;
+	}
+	sprintf(snapshotPath, SNAPSHOT_FILE, p->port);
 
+	if(takeover) {
+		if(!_receiveHandoff(p->port)) {
+			exit(EXIT_FAILURE);
+		}
+		printf("Took over from the previous server\n");
+	} else {
+		_loadSnapshot();
+		_listen(p->port);
+	}
+
+	pipe(wakePipe);
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+	pthread_t schedulerThread;
+	pthread_create(&schedulerThread, NULL, threadScheduler, NULL);
+
+	pthread_t snapshotThread;
+	pthread_create(&snapshotThread, NULL, threadSnapshot, NULL);
+
+	// Also resumes reading the connections received from the previous server
+	_startServing();
+
+	// Returns once the sockets were handed to a new server, which carries on relaying
+	_waitForHandoff(p->port);
 	
 	return 0;
 }
-